@@ -3,6 +3,9 @@
  * using multiple height generation functions (scaling, modulus) and
  * multiple smoothing functions (none, weighted, modulus).
  *
+ * With --channels, show instead the heights obtained from independent
+ * channels (heights, biome, colour, features) split off each seed.
+ *
  * TODO:
  *   * produce 4, 8, 16 or 64 heights by decoding the hash as a sequence
  *     of uint64_t, uint32_t, uint16_t and nibbles;
@@ -19,6 +22,9 @@
 
 #include <openssl/sha.h>
 
+#include "digest-cache.h"
+#include "digest-stream.h"
+
 #define PURE __attribute__((pure))
 #define UNUSED __attribute__((unused))
 #define ARRAY_SIZE(ar) (sizeof(ar)/sizeof(*ar))
@@ -287,6 +293,9 @@ static const struct filter process_filters[] = {
 
 static const size_t num_process_filters = ARRAY_SIZE(process_filters);
 
+/* Optional persistent digest cache, see digest-cache.h */
+static struct digest_cache *digest_cache;
+
 /* Create (and show) every combination of preprocess + height +
  * postprocess filter, starting with the SHA256 of the given byte
  * sequence `src` of given length `len`.
@@ -303,7 +312,7 @@ static void render_all(uchar *src, size_t len)
 	ENC_ALLOC(&base_hash, SHA256_DIGEST_LENGTH);
 	base_hash.maxval = UCHAR_MAX;
 
-	SHA256(src, len, base_hash.data);
+	cached_sha256(digest_cache, src, len, base_hash.data);
 #if 0 /* debug */
 	for (size_t i = 0; i < SHA256_DIGEST_LENGTH; ++i)
 		printf("| %2x ", base_hash.data[i]);
@@ -341,10 +350,80 @@ static void render_all(uchar *src, size_t len)
 	ENC_FREE(&base_hash);
 }
 
-int main(int argc UNUSED, char *argv[] UNUSED)
+/* Channels shown with --channels */
+static const char * const channels[] = {
+	CHANNEL_HEIGHTS,
+	CHANNEL_BIOME,
+	CHANNEL_COLOUR,
+	CHANNEL_FEATURES,
+};
+
+static const size_t num_channels = ARRAY_SIZE(channels);
+
+/* Show the linearly scaled heights of each channel split off the SHA256
+ * of the given byte sequence `src` of given length `len`.
+ */
+static void render_channels(uchar *src, size_t len)
+{
+	uchar digest[SHA256_DIGEST_LENGTH];
+	struct digest_split split;
+	struct encmap raw, heights;
+
+	cached_sha256(digest_cache, src, len, digest);
+	digest_split_init_digest(&split, digest);
+
+	ENC_ALLOC(&raw, SHA256_DIGEST_LENGTH);
+	raw.maxval = UCHAR_MAX;
+
+	for (size_t c = 0; c < num_channels; ++c)
+	{
+		struct digest_stream stream;
+		digest_stream_open(&stream, &split, channels[c]);
+		digest_stream_read(&stream, raw.data, raw.count);
+
+		heights.maxval = sparks_max;
+		linear_scale(&heights, &raw);
+		spark_encmap(&heights);
+		if (c < num_channels - 1)
+			fputs("\t", stdout);
+		ENC_FREE(&heights);
+	}
+	ENC_FREE(&raw);
+}
+
+static void show_channels(void)
+{
+	uchar src[] = { 0 };
+
+	printf("    \t");
+	for (size_t c = 0; c < num_channels; ++c)
+		printf("%-*s%s", SHA256_DIGEST_LENGTH, channels[c],
+			c < num_channels - 1 ? "\t" : "\n");
+
+	printf("\n----\t");
+	render_channels(src, 0);
+	for (uint v = 0; v <= UCHAR_MAX; ++v)
+	{
+		src[0] = v;
+		printf("\n%4u\t", v);
+		render_channels(src, 1);
+	}
+	puts("");
+}
+
+int main(int argc, char *argv[])
 {
 	uchar src[] = { 0 };
 
+	digest_cache = digest_cache_from_env();
+
+	if (argc > 1 && !strcmp(argv[1], "--channels"))
+	{
+		show_channels();
+		digest_cache_close(digest_cache);
+		return 0;
+	}
+
 	/* Header */
 	printf("    \t");
 	for (size_t s = 0; s < num_process_filters; ++s)
@@ -399,5 +478,6 @@ int main(int argc UNUSED, char *argv[] UNUSED)
 	}
 	puts("");
 
+	digest_cache_close(digest_cache);
 	return 0;
 }
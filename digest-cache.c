@@ -0,0 +1,271 @@
+/* Persistent memory-mapped digest cache, see digest-cache.h */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+
+#include "digest-cache.h"
+
+typedef unsigned char uchar;
+
+static const char cache_magic[8] = "PDDCACHE";
+
+/* Slot states */
+#define SLOT_EMPTY 0
+#define SLOT_BUSY 1 /* claimed by a writer, contents not valid yet */
+#define SLOT_FULL 2
+
+/* Give up on a lookup/store after this many probes */
+#define MAX_PROBES 32
+
+/* File header. The slots follow, starting at offset sizeof(header) */
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t slot_size;
+	uint64_t nslots; /* always a power of two */
+	uint64_t used; /* number of filled slots, informational */
+	uchar reserved[32];
+};
+
+/* A slot is exactly 128 bytes */
+struct cache_slot {
+	uint32_t state;
+	uint8_t algo;
+	uint8_t keylen;
+	uint8_t digest_len;
+	uint8_t reserved;
+	uint64_t keyhash;
+	uchar digest[DIGEST_CACHE_MAX_DIGEST];
+	uchar key[DIGEST_CACHE_MAX_KEY];
+};
+
+struct digest_cache {
+	struct cache_header *header;
+	struct cache_slot *slots;
+	size_t map_size;
+	uint64_t mask;
+	int fd;
+};
+
+/* Digest algorithms we know about */
+struct digest_desc {
+	size_t len;
+	uchar *(*func)(const uchar *msg, size_t len, uchar *out);
+};
+
+static const struct digest_desc *digest_desc(enum digest_algo algo)
+{
+	static const struct digest_desc sha256 = { SHA256_DIGEST_LENGTH, SHA256 };
+	static const struct digest_desc md5 = { MD5_DIGEST_LENGTH, MD5 };
+	switch (algo) {
+	case DIGEST_SHA256:
+		return &sha256;
+	case DIGEST_MD5:
+		return &md5;
+	}
+	fprintf(stderr, "unknown digest algorithm %d\n", algo);
+	abort();
+}
+
+/* FNV-1a, mixed with the algorithm id */
+static uint64_t key_hash(enum digest_algo algo, const uchar *msg, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ (uint64_t)algo;
+	for (size_t i = 0; i < len; ++i) {
+		h ^= msg[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static bool valid_header(struct cache_header const *hdr, size_t file_size)
+{
+	if (memcmp(hdr->magic, cache_magic, sizeof(cache_magic)))
+		return false;
+	if (hdr->version != DIGEST_CACHE_VERSION ||
+		hdr->slot_size != sizeof(struct cache_slot))
+		return false;
+	if (!hdr->nslots || (hdr->nslots & (hdr->nslots - 1)))
+		return false;
+	return file_size == sizeof(*hdr) + hdr->nslots*sizeof(struct cache_slot);
+}
+
+struct digest_cache *digest_cache_open(const char *path, size_t max_size)
+{
+	if (!max_size)
+		max_size = DIGEST_CACHE_DEFAULT_SIZE;
+
+	/* Largest power-of-two slot count fitting the size cap */
+	uint64_t nslots = 1;
+	while (sizeof(struct cache_header) + 2*nslots*sizeof(struct cache_slot) <= max_size)
+		nslots *= 2;
+	if (sizeof(struct cache_header) + nslots*sizeof(struct cache_slot) > max_size) {
+		fprintf(stderr, "digest cache %s: size cap %zu too small\n",
+			path, max_size);
+		return NULL;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "digest cache %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	/* Initialization is done under an exclusive lock, so that
+	 * concurrent first runs don't step on each other's toes */
+	struct stat st;
+	if (flock(fd, LOCK_EX) || fstat(fd, &st))
+		goto fail;
+
+	if (st.st_size == 0) {
+		struct cache_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, cache_magic, sizeof(cache_magic));
+		hdr.version = DIGEST_CACHE_VERSION;
+		hdr.slot_size = sizeof(struct cache_slot);
+		hdr.nslots = nslots;
+		st.st_size = sizeof(hdr) + nslots*sizeof(struct cache_slot);
+		/* The slots are zero-filled (i.e. empty) by ftruncate */
+		if (ftruncate(fd, st.st_size) ||
+			pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			goto fail;
+	}
+
+	if ((size_t)st.st_size < sizeof(struct cache_header)) {
+		fprintf(stderr, "digest cache %s: truncated, ignoring\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	flock(fd, LOCK_UN);
+
+	struct digest_cache *cache = malloc(sizeof(*cache));
+	if (!cache) {
+		munmap(map, st.st_size);
+		goto fail;
+	}
+	cache->header = map;
+	cache->slots = (struct cache_slot *)(cache->header + 1);
+	cache->map_size = st.st_size;
+	cache->mask = cache->header->nslots - 1;
+	cache->fd = fd;
+
+	if (!valid_header(cache->header, st.st_size)) {
+		fprintf(stderr, "digest cache %s: not a version %u cache, ignoring\n",
+			path, DIGEST_CACHE_VERSION);
+		digest_cache_close(cache);
+		return NULL;
+	}
+
+	return cache;
+
+fail:
+	fprintf(stderr, "digest cache %s: %s\n", path, strerror(errno));
+	close(fd);
+	return NULL;
+}
+
+struct digest_cache *digest_cache_from_env(void)
+{
+	const char *path = getenv(DIGEST_CACHE_ENV);
+	if (!path || !*path)
+		return NULL;
+	const char *size_env = getenv(DIGEST_CACHE_SIZE_ENV);
+	size_t max_size = 0;
+	if (size_env && *size_env)
+		max_size = strtoull(size_env, NULL, 0);
+	return digest_cache_open(path, max_size);
+}
+
+void digest_cache_close(struct digest_cache *cache)
+{
+	if (!cache)
+		return;
+	munmap(cache->header, cache->map_size);
+	close(cache->fd);
+	free(cache);
+}
+
+static bool slot_matches(struct cache_slot const *slot, uint64_t hash,
+	enum digest_algo algo, const uchar *msg, size_t len)
+{
+	return slot->keyhash == hash && slot->algo == algo &&
+		slot->keylen == len && !memcmp(slot->key, msg, len);
+}
+
+void digest_cache_get(struct digest_cache *cache, enum digest_algo algo,
+	const unsigned char *msg, size_t len, unsigned char *out)
+{
+	const struct digest_desc *desc = digest_desc(algo);
+
+	if (!cache || len > DIGEST_CACHE_MAX_KEY || desc->len > DIGEST_CACHE_MAX_DIGEST) {
+		desc->func(msg, len, out);
+		return;
+	}
+
+	const uint64_t hash = key_hash(algo, msg, len);
+	uint64_t idx = hash & cache->mask;
+	bool computed = false;
+
+	for (int probe = 0; probe < MAX_PROBES; ++probe, idx = (idx + 1) & cache->mask) {
+		struct cache_slot *slot = cache->slots + idx;
+		uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+		if (state == SLOT_FULL) {
+			if (slot_matches(slot, hash, algo, msg, len)) {
+				memcpy(out, slot->digest, desc->len);
+				return;
+			}
+			continue;
+		}
+		/* A slot being written by someone else: it might be our key,
+		 * but we don't wait for it */
+		if (state == SLOT_BUSY)
+			continue;
+
+		/* Empty slot: the key is not in the table, compute the digest
+		 * and try to claim the slot for it. If someone else beats us
+		 * to it, look at the slot again */
+		if (!computed) {
+			desc->func(msg, len, out);
+			computed = true;
+		}
+		if (!__atomic_compare_exchange_n(&slot->state, &state, SLOT_BUSY,
+				false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			if (state == SLOT_FULL && slot_matches(slot, hash, algo, msg, len))
+				return;
+			continue;
+		}
+		slot->algo = algo;
+		slot->keylen = len;
+		slot->digest_len = desc->len;
+		slot->keyhash = hash;
+		memcpy(slot->key, msg, len);
+		memcpy(slot->digest, out, desc->len);
+		__atomic_store_n(&slot->state, SLOT_FULL, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&cache->header->used, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	/* Too many collisions: the table is (locally) full */
+	if (!computed)
+		desc->func(msg, len, out);
+}
@@ -0,0 +1,72 @@
+/* Persistent digest cache.
+ *
+ * Procedural generation keeps hashing the same (short) messages over and
+ * over, e.g. the coordinates of the same world regions on every run. The
+ * digest cache remembers the digests across runs in a memory-mapped file,
+ * laid out as an open-addressing hash table keyed by the message and the
+ * digest algorithm.
+ *
+ * Entries are never modified nor evicted once written, so any number of
+ * processes can look up the cache concurrently without locking; writers
+ * claim empty slots with an atomic compare-and-swap and publish them only
+ * after the digest has been written. When the table fills up (or a message
+ * is too long to be used as key) the digest is simply computed and not
+ * stored.
+ */
+
+#ifndef DIGEST_CACHE_H
+#define DIGEST_CACHE_H
+
+#include <stddef.h>
+
+/* Bump this whenever the on-disk layout changes */
+#define DIGEST_CACHE_VERSION 1
+
+/* Longest message that can be used as key */
+#define DIGEST_CACHE_MAX_KEY 80
+/* Longest digest that can be stored */
+#define DIGEST_CACHE_MAX_DIGEST 32
+
+/* Default cap on the cache file size, in bytes */
+#define DIGEST_CACHE_DEFAULT_SIZE (64UL << 20)
+
+/* Environment variables used by digest_cache_from_env() */
+#define DIGEST_CACHE_ENV "PROCDIG_DIGEST_CACHE"
+#define DIGEST_CACHE_SIZE_ENV "PROCDIG_DIGEST_CACHE_SIZE"
+
+enum digest_algo {
+	DIGEST_SHA256 = 1,
+	DIGEST_MD5 = 2,
+};
+
+struct digest_cache;
+
+/* Open (creating it if needed) the cache stored at path. The file will be
+ * at most max_size bytes; a max_size of zero selects the default. An
+ * existing cache keeps its own size. Returns NULL (with a message on
+ * stderr) if the cache cannot be used, in which case callers should
+ * just hash without it.
+ */
+struct digest_cache *digest_cache_open(const char *path, size_t max_size);
+
+/* Open the cache named by the PROCDIG_DIGEST_CACHE environment variable,
+ * with the size cap from PROCDIG_DIGEST_CACHE_SIZE (if set).
+ * Returns NULL if the variable is not set or the cache cannot be used */
+struct digest_cache *digest_cache_from_env(void);
+
+void digest_cache_close(struct digest_cache *cache);
+
+/* Compute the digest of msg with the given algorithm, going through the
+ * cache (which may be NULL). out must have room for the digest length of
+ * the algorithm */
+void digest_cache_get(struct digest_cache *cache, enum digest_algo algo,
+	const unsigned char *msg, size_t len, unsigned char *out);
+
+/* Shorthand for the most common case */
+static inline void cached_sha256(struct digest_cache *cache,
+	const unsigned char *msg, size_t len, unsigned char *out)
+{
+	digest_cache_get(cache, DIGEST_SHA256, msg, len, out);
+}
+
+#endif
@@ -0,0 +1,61 @@
+/* Digest stream splitter, see digest-stream.h */
+
+#include <string.h>
+
+#include "digest-stream.h"
+
+typedef unsigned char uchar;
+
+void digest_split_init(struct digest_split *split,
+	const unsigned char *msg, size_t len)
+{
+	SHA256(msg, len, split->seed);
+}
+
+void digest_split_init_digest(struct digest_split *split,
+	const unsigned char *digest)
+{
+	memcpy(split->seed, digest, sizeof(split->seed));
+}
+
+void digest_stream_open(struct digest_stream *stream,
+	struct digest_split const *split, const char *name)
+{
+	SHA256_Init(&stream->base);
+	SHA256_Update(&stream->base, split->seed, sizeof(split->seed));
+	/* The terminator keeps e.g. "a" || "b..." from colliding with "ab" || "..." */
+	SHA256_Update(&stream->base, name, strlen(name) + 1);
+	stream->counter = 0;
+	/* Empty block: the first read will compute block 0 */
+	stream->cursor = sizeof(stream->block);
+}
+
+/* Compute the next block of the stream */
+static void refill(struct digest_stream *stream)
+{
+	uchar ctr[8];
+	for (size_t i = 0; i < sizeof(ctr); ++i)
+		ctr[i] = stream->counter >> (8*i);
+
+	SHA256_CTX ctx = stream->base;
+	SHA256_Update(&ctx, ctr, sizeof(ctr));
+	SHA256_Final(stream->block, &ctx);
+
+	++stream->counter;
+	stream->cursor = 0;
+}
+
+void digest_stream_read(struct digest_stream *stream,
+	unsigned char *out, size_t len)
+{
+	while (len) {
+		if (stream->cursor == sizeof(stream->block))
+			refill(stream);
+		size_t avail = sizeof(stream->block) - stream->cursor;
+		size_t chunk = len < avail ? len : avail;
+		memcpy(out, stream->block + stream->cursor, chunk);
+		stream->cursor += chunk;
+		out += chunk;
+		len -= chunk;
+	}
+}
@@ -0,0 +1,67 @@
+/* Digest stream splitter.
+ *
+ * A single digest only gives us 32 bytes, and when different aspects of
+ * the generation (heights, biome, colour, ...) draw from the same
+ * digest they end up competing for its bytes. The splitter derives from
+ * one seed any number of independent byte streams, one per named
+ * channel: block i of channel `name` for seed digest S is
+ *
+ *     SHA256(S || name || NUL || le64(i))
+ *
+ * Blocks are computed lazily (in counter mode) only when the consumer
+ * runs out of bytes, so channels nobody reads cost nothing, and the
+ * channels read cost no more than the bytes actually consumed.
+ */
+
+#ifndef DIGEST_STREAM_H
+#define DIGEST_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/sha.h>
+
+/* Standard channel names, for consistency across the sample programs */
+#define CHANNEL_HEIGHTS "heights"
+#define CHANNEL_BIOME "biome"
+#define CHANNEL_COLOUR "colour"
+#define CHANNEL_FEATURES "features"
+
+/* The seed all channels are derived from */
+struct digest_split {
+	unsigned char seed[SHA256_DIGEST_LENGTH];
+};
+
+/* One named channel */
+struct digest_stream {
+	SHA256_CTX base; /* hash state after seed and name */
+	uint64_t counter; /* index of the next block to compute */
+	size_t cursor; /* next byte to return from block */
+	unsigned char block[SHA256_DIGEST_LENGTH];
+};
+
+/* Seed the splitter with the digest of a message */
+void digest_split_init(struct digest_split *split,
+	const unsigned char *msg, size_t len);
+
+/* Seed the splitter with an already computed digest */
+void digest_split_init_digest(struct digest_split *split,
+	const unsigned char *digest);
+
+/* Open the named channel; this doesn't compute anything yet */
+void digest_stream_open(struct digest_stream *stream,
+	struct digest_split const *split, const char *name);
+
+/* Read the next len bytes from the stream into out */
+void digest_stream_read(struct digest_stream *stream,
+	unsigned char *out, size_t len);
+
+/* Read the next byte from the stream */
+static inline unsigned char digest_stream_byte(struct digest_stream *stream)
+{
+	unsigned char byte;
+	digest_stream_read(stream, &byte, 1);
+	return byte;
+}
+
+#endif
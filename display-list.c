@@ -0,0 +1,122 @@
+/* Display list of drawing primitives, see display-list.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include "display-list.h"
+
+static size_t prim_size(size_t npoints)
+{
+	return sizeof(struct dl_prim) + npoints*sizeof(struct dl_point);
+}
+
+void dl_init(struct display_list *dl)
+{
+	memset(dl, 0, sizeof(*dl));
+}
+
+void dl_reset(struct display_list *dl)
+{
+	dl->len = 0;
+	dl->count = 0;
+}
+
+void dl_free(struct display_list *dl)
+{
+	free(dl->arena);
+	dl_init(dl);
+}
+
+struct dl_prim *dl_add(struct display_list *dl, enum dl_op op, size_t npoints)
+{
+	if (npoints > DL_MAX_POINTS) {
+		fprintf(stderr, "too many points (%zu) in a primitive\n", npoints);
+		abort();
+	}
+
+	const size_t size = prim_size(npoints);
+	if (dl->cap - dl->len < size) {
+		size_t cap = dl->cap ? dl->cap : 4096;
+		while (cap - dl->len < size)
+			cap *= 2;
+		unsigned char *arena = realloc(dl->arena, cap);
+		if (arena == NULL)
+		{
+			fprintf(stderr, "out of memory");
+			abort();
+		}
+		dl->arena = arena;
+		dl->cap = cap;
+	}
+
+	struct dl_prim *prim = (struct dl_prim *)(dl->arena + dl->len);
+	memset(prim, 0, size);
+	prim->op = op;
+	prim->npoints = npoints;
+	dl->len += size;
+	++dl->count;
+	return prim;
+}
+
+struct dl_prim const *dl_next(struct display_list const *dl,
+	struct dl_prim const *prim)
+{
+	const size_t next = prim ?
+		(size_t)((unsigned char const *)prim - dl->arena) +
+		prim_size(prim->npoints) : 0;
+	return next < dl->len ? (struct dl_prim const *)(dl->arena + next) : NULL;
+}
+
+static void copy_prim(struct display_list *dst, struct dl_prim const *prim)
+{
+	struct dl_prim *copy = dl_add(dst, prim->op, prim->npoints);
+	memcpy(copy, prim, prim_size(prim->npoints));
+}
+
+/* Which layer the primitive goes to, -1 if not a stroke */
+static int stroke_layer(struct dl_prim const *prim)
+{
+	switch (prim->op) {
+	case DL_CIRCLE:
+	case DL_POLYLINE:
+	case DL_ARC_PATH:
+		return prim->stroke == DL_OVERSTROKE;
+	default:
+		return -1;
+	}
+}
+
+void dl_sort_strokes(struct display_list *dst, struct display_list const *src)
+{
+	struct dl_prim const *prim;
+
+	for (prim = dl_next(src, NULL); prim; prim = dl_next(src, prim))
+		if (prim->op == DL_NOTE)
+			copy_prim(dst, prim);
+
+	/* There are only a handful of widths, so each layer is copied one
+	 * width at a time, rather than sorted */
+	for (int layer = 0; layer < 2; ++layer) {
+		int width = INT_MIN;
+		for (;;) {
+			bool found = false;
+			int next = INT_MAX;
+			for (prim = dl_next(src, NULL); prim; prim = dl_next(src, prim)) {
+				if (stroke_layer(prim) == layer &&
+					prim->width > width && prim->width <= next) {
+					next = prim->width;
+					found = true;
+				}
+			}
+			if (!found)
+				break;
+			for (prim = dl_next(src, NULL); prim; prim = dl_next(src, prim))
+				if (stroke_layer(prim) == layer && prim->width == next)
+					copy_prim(dst, prim);
+			width = next;
+		}
+	}
+}
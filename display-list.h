@@ -0,0 +1,126 @@
+/* Display list of drawing primitives.
+ *
+ * Rather than printing the geometry while computing it, the drawing code
+ * appends primitives (circles, polylines, arc paths, each with its stroke)
+ * to a display list, which is then walked by any number of backends (SVG,
+ * raster, ...). The list can be reordered or deduplicated before output.
+ *
+ * All the primitives live in a single growable arena, one after the other,
+ * and refer to nothing outside of it (no pointers), so a list can be
+ * copied or cached as a plain block of memory. A list is meant to be
+ * reset and reused, so that drawing doesn't allocate once the arena has
+ * grown to the size of the largest drawing.
+ */
+
+#ifndef DISPLAY_LIST_H
+#define DISPLAY_LIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Rotations are in units of 1/DL_TURN of a turn, clockwise from the top */
+#define DL_TURN 840
+
+enum dl_op {
+	DL_GROUP, /* start of a group of primitives, e.g. a feature */
+	DL_END_GROUP,
+	DL_NOTE, /* something for the reader, no geometry */
+	DL_CIRCLE,
+	DL_POLYLINE, /* closed polyline, possibly with gaps */
+	DL_ARC_PATH, /* closed sequence of circular arcs */
+};
+
+enum dl_stroke {
+	DL_HAIRLINE, /* thinnest line the backend can draw */
+	DL_UNDERSTROKE, /* stroke in the foreground colour */
+	DL_OVERSTROKE, /* stroke in the background colour, over an understroke */
+};
+
+struct dl_point {
+	int x;
+	int y;
+};
+
+/* Identifies paths which are the same up to a translation and rotation.
+ * What the fields mean is up to the producer, backends only compare them */
+struct dl_shape {
+	int kind;
+	int param[4];
+};
+
+struct dl_prim {
+	uint8_t op; /* enum dl_op */
+	uint8_t stroke; /* enum dl_stroke */
+	uint8_t npoints; /* number of points following the primitive */
+	uint16_t breaks; /* DL_POLYLINE: bit i set if point i starts a new piece */
+	int width; /* stroke width, 0 for hairlines */
+	union {
+		/* DL_GROUP: what the group is, up to the producer */
+		struct {
+			int kind;
+			int order;
+		} group;
+		/* DL_NOTE: flags that were ignored, out of all the flags */
+		struct {
+			int flags;
+			int all;
+		} note;
+		/* DL_CIRCLE */
+		struct {
+			int cx;
+			int cy;
+			int r;
+		} circle;
+		/* DL_POLYLINE, DL_ARC_PATH: the points are the absolute
+		 * coordinates; the same path is also described as the
+		 * given shape moved to cx, cy and rotated by bearing, and
+		 * the producer expects to draw it `instances` times */
+		struct {
+			struct dl_shape shape;
+			int cx;
+			int cy;
+			int bearing;
+			int radius; /* DL_ARC_PATH */
+			int instances;
+		} path;
+	};
+	struct dl_point points[];
+};
+
+#define DL_MAX_POINTS UINT8_MAX
+
+struct display_list {
+	unsigned char *arena;
+	size_t len;
+	size_t cap;
+	size_t count; /* number of primitives */
+};
+
+void dl_init(struct display_list *dl);
+
+/* Empty the list, keeping the arena */
+void dl_reset(struct display_list *dl);
+
+void dl_free(struct display_list *dl);
+
+/* Append a primitive with room for npoints points, zero-filled but for
+ * op and npoints. The returned pointer (like those returned by dl_next())
+ * is only valid until the next dl_add() */
+struct dl_prim *dl_add(struct display_list *dl, enum dl_op op, size_t npoints);
+
+/* Iterate over the primitives: dl_next(dl, NULL) returns the first one,
+ * and NULL is returned after the last */
+struct dl_prim const *dl_next(struct display_list const *dl,
+	struct dl_prim const *prim);
+
+/* Append to dst the primitives of src, sorted into two layers: first
+ * whatever is drawn in the foreground colour (hairlines and understrokes),
+ * then the overstrokes, each layer by increasing stroke width and
+ * otherwise in the order of src. Since each layer is drawn in a single
+ * colour, this only changes how strokes overlap: an overstroke is no
+ * longer crossed by the understrokes of whatever is drawn after it.
+ * Notes come first; groups are dropped, as their primitives end up
+ * scattered across the layers */
+void dl_sort_strokes(struct display_list *dst, struct display_list const *src);
+
+#endif
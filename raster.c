@@ -0,0 +1,681 @@
+/* Anti-aliased rasterizer for display lists, see raster.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <math.h>
+
+#include "raster.h"
+
+#ifndef M_PI
+#define M_PI 3.1415926535897932384626433832795
+#endif
+
+/* Width of hairlines, in drawing units: SVG's default stroke width */
+#define HAIRLINE_WIDTH 1.0f
+
+/* SVG's default stroke-miterlimit */
+#define MITER_LIMIT 4.0f
+
+/* Maximum distance between arcs and the segments approximating them,
+ * in pixels */
+#define FLATTEN_TOLERANCE 0.1f
+
+struct raster_point {
+	float x;
+	float y;
+};
+
+/* Edge of a polygon, in pixels */
+struct raster_line {
+	float x0, y0;
+	float x1, y1;
+};
+
+/* Cells of a row of the coverage buffer touched by edges */
+struct raster_span {
+	int min;
+	int max;
+};
+
+static void *grow(void *p, size_t *cap, size_t need, size_t size)
+{
+	if (need <= *cap)
+		return p;
+	size_t new_cap = *cap ? *cap : 64;
+	while (new_cap < need)
+		new_cap *= 2;
+	p = realloc(p, new_cap*size);
+	if (p == NULL)
+	{
+		fprintf(stderr, "out of memory");
+		abort();
+	}
+	*cap = new_cap;
+	return p;
+}
+
+void raster_init(struct raster *r, int size, float origin, float extent)
+{
+	memset(r, 0, sizeof(*r));
+	r->size = size;
+	r->scale = size/extent;
+	r->origin = origin;
+	r->pixels = malloc((size_t)size*size);
+	if (r->pixels == NULL)
+	{
+		fprintf(stderr, "out of memory");
+		abort();
+	}
+}
+
+void raster_free(struct raster *r)
+{
+	free(r->pixels);
+	free(r->lines);
+	free(r->path);
+	free(r->cover);
+	free(r->spans);
+	memset(r, 0, sizeof(*r));
+}
+
+static struct raster_point to_pixels(struct raster const *r, int x, int y)
+{
+	const struct raster_point p = {
+		(x - r->origin)*r->scale,
+		(y - r->origin)*r->scale,
+	};
+	return p;
+}
+
+/* Polygons */
+
+static void add_line(struct raster *r, struct raster_point a, struct raster_point b)
+{
+	r->lines = grow(r->lines, &r->lines_cap, r->nlines + 1, sizeof(*r->lines));
+	const struct raster_line line = { a.x, a.y, b.x, b.y };
+	r->lines[r->nlines++] = line;
+}
+
+static void add_polygon(struct raster *r, struct raster_point const *p, size_t n,
+	bool reverse)
+{
+	for (size_t i = 0; i < n; ++i) {
+		const struct raster_point a = p[i], b = p[(i + 1) % n];
+		if (reverse)
+			add_line(r, b, a);
+		else
+			add_line(r, a, b);
+	}
+}
+
+/* Add a convex polygon, of either orientation. All the pieces of a
+ * stroke are added with the same orientation, so that their coverages
+ * add up where they overlap or touch, rather than cancel out */
+static void add_convex(struct raster *r, struct raster_point const *p, size_t n)
+{
+	float area = 0;
+	for (size_t i = 0; i < n; ++i) {
+		const struct raster_point a = p[i], b = p[(i + 1) % n];
+		area += a.x*b.y - a.y*b.x;
+	}
+	if (fabsf(area) < 1e-6f)
+		return;
+	add_polygon(r, p, n, area < 0);
+}
+
+/* Path scratch space */
+
+static void push_point(struct raster *r, size_t *len, float x, float y)
+{
+	r->path = grow(r->path, &r->path_cap, *len + 1, sizeof(*r->path));
+	const struct raster_point p = { x, y };
+	r->path[(*len)++] = p;
+}
+
+/* Number of segments approximating an arc of the given angle and radius
+ * (in pixels) within FLATTEN_TOLERANCE */
+static int arc_segments(float angle, float radius)
+{
+	const float step = radius > FLATTEN_TOLERANCE ?
+		2*acosf(1 - FLATTEN_TOLERANCE/radius) : M_PI/2;
+	const int n = ceilf(angle/step);
+	return n < 1 ? 1 : n;
+}
+
+/* Append the points strictly between a and b of the small arc of the
+ * given radius from a to b, turning clockwise on the image (SVG's arc
+ * with large-arc-flag 0 and sweep-flag 1). As in SVG, radii too small
+ * for the arc to reach b are scaled up */
+static void push_arc(struct raster *r, size_t *len, struct raster_point a,
+	struct raster_point b, float radius)
+{
+	const float hx = (a.x - b.x)/2, hy = (a.y - b.y)/2;
+	const float d2 = hx*hx + hy*hy;
+	if (d2 == 0)
+		return;
+	const float r2 = fmaxf(radius*radius, d2);
+	const float k = sqrtf((r2 - d2)/d2);
+	const float cx = (a.x + b.x)/2 + k*hy;
+	const float cy = (a.y + b.y)/2 - k*hx;
+	const float rr = sqrtf(r2);
+
+	const float t0 = atan2f(a.y - cy, a.x - cx);
+	float sweep = atan2f(b.y - cy, b.x - cx) - t0;
+	if (sweep < 0)
+		sweep += 2*M_PI;
+	const int n = arc_segments(sweep, rr);
+	for (int i = 1; i < n; ++i) {
+		const float t = t0 + sweep*i/n;
+		push_point(r, len, cx + rr*cosf(t), cy + rr*sinf(t));
+	}
+}
+
+/* Strokes */
+
+static struct raster_point direction(struct raster_point a, struct raster_point b)
+{
+	const float dx = b.x - a.x, dy = b.y - a.y;
+	const float len = sqrtf(dx*dx + dy*dy);
+	const struct raster_point u = { dx/len, dy/len };
+	return u;
+}
+
+/* Add the join at b between a segment going in direction u1 and the next
+ * one going in direction u2: what sticks out of the two rectangles on the
+ * outer side of the turn, up to the miter tip or, past the miter limit,
+ * just the bevel */
+static void add_join(struct raster *r, struct raster_point b,
+	struct raster_point u1, struct raster_point u2, float h)
+{
+	const float cross = u1.x*u2.y - u1.y*u2.x;
+	const float dot = u1.x*u2.x + u1.y*u2.y;
+	if (fabsf(cross) < 1e-6f)
+		return;
+
+	/* Outer offsets of the two segments */
+	const float s = cross > 0 ? -h : h;
+	const struct raster_point o1 = { -u1.y*s, u1.x*s };
+	const struct raster_point o2 = { -u2.y*s, u2.x*s };
+
+	struct raster_point p[4] = {
+		b,
+		{ b.x + o1.x, b.y + o1.y },
+		{ b.x + o2.x, b.y + o2.y },
+	};
+	/* Squared cosine of half the turn: the miter is 1/cos as long as
+	 * the stroke is wide */
+	const float c2 = (1 + dot)/2;
+	if (c2*MITER_LIMIT*MITER_LIMIT < 1) {
+		add_convex(r, p, 3);
+		return;
+	}
+	p[3] = p[2];
+	p[2].x = b.x + (o1.x + o2.x)/(2*c2);
+	p[2].y = b.y + (o1.y + o2.y)/(2*c2);
+	add_convex(r, p, 4);
+}
+
+/* Add the outline of the stroke of half width h along the n points
+ * (which are clobbered) */
+static void stroke_path(struct raster *r, struct raster_point *p, size_t n,
+	bool closed, float h)
+{
+	/* Repeated points have no direction */
+	size_t m = 0;
+	for (size_t i = 0; i < n; ++i)
+		if (!m || p[i].x != p[m-1].x || p[i].y != p[m-1].y)
+			p[m++] = p[i];
+	if (closed && m > 1 && p[m-1].x == p[0].x && p[m-1].y == p[0].y)
+		--m;
+	if (m < 2)
+		return;
+
+	/* Segments, with butt ends */
+	const size_t nseg = closed ? m : m - 1;
+	for (size_t i = 0; i < nseg; ++i) {
+		const struct raster_point a = p[i], b = p[(i + 1) % m];
+		const struct raster_point u = direction(a, b);
+		const float nx = -u.y*h, ny = u.x*h;
+		const struct raster_point rect[4] = {
+			{ a.x + nx, a.y + ny },
+			{ b.x + nx, b.y + ny },
+			{ b.x - nx, b.y - ny },
+			{ a.x - nx, a.y - ny },
+		};
+		add_convex(r, rect, 4);
+	}
+
+	/* Joins */
+	for (size_t i = closed ? 0 : 1; i < (closed ? m : m - 1); ++i) {
+		const struct raster_point prev = p[(i + m - 1) % m];
+		const struct raster_point next = p[(i + 1) % m];
+		add_join(r, p[i], direction(prev, p[i]), direction(p[i], next), h);
+	}
+}
+
+static void add_circle(struct raster *r, struct raster_point c, float radius,
+	bool reverse)
+{
+	int n = arc_segments(2*M_PI, radius);
+	if (n < 8)
+		n = 8;
+	size_t len = 0;
+	for (int i = 0; i < n; ++i) {
+		const float t = 2*M_PI*i/n;
+		push_point(r, &len, c.x + radius*cosf(t), c.y + radius*sinf(t));
+	}
+	add_polygon(r, r->path, len, reverse);
+}
+
+/* Coverage */
+
+typedef float v4f __attribute__((vector_size(16)));
+typedef int32_t v4i __attribute__((vector_size(16)));
+
+/* Accumulate the signed area of the line, in coordinates relative to the
+ * coverage buffer of h rows: each pixel the line crosses gets the area to
+ * its right, up to the next pixel, which gets the rest. The coverage of a
+ * pixel is then the sum of the buffer up to it on its row (see font-rs) */
+static void cover_line(float *cover, size_t stride, struct raster_span *spans,
+	int h, float x0, float y0, float x1, float y1)
+{
+	float dir = 1;
+	if (y0 == y1)
+		return;
+	if (y0 > y1) {
+		float t = x0; x0 = x1; x1 = t;
+		t = y0; y0 = y1; y1 = t;
+		dir = -1;
+	}
+	const float dxdy = (x1 - x0)/(y1 - y0);
+	float x = x0;
+	if (y0 < 0)
+		x -= y0*dxdy;
+	const int ystart = y0 < 0 ? 0 : (int)y0;
+	const int yend = fminf(h, ceilf(y1));
+	for (int y = ystart; y < yend; ++y) {
+		float *row = cover + y*stride;
+		const float dy = fminf(y + 1, y1) - fmaxf(y, y0);
+		const float xnext = x + dxdy*dy;
+		const float d = dy*dir;
+		const float xa = fminf(x, xnext), xb = fmaxf(x, xnext);
+		const float xafloor = floorf(xa);
+		const int xai = xafloor;
+		const float xbceil = ceilf(xb);
+		const int xbi = xbceil;
+		struct raster_span *span = spans + y;
+		if (xai < span->min)
+			span->min = xai;
+		if (xbi <= xai + 1) {
+			const float xmf = (x + xnext)/2 - xafloor;
+			row[xai] += d - d*xmf;
+			row[xai + 1] += d*xmf;
+			if (xai + 1 > span->max)
+				span->max = xai + 1;
+		} else {
+			const float s = 1/(xb - xa);
+			const float xaf = xa - xafloor;
+			const float a0 = s*(1 - xaf)*(1 - xaf)/2;
+			const float xbf = xb - xbceil + 1;
+			const float am = s*xbf*xbf/2;
+			row[xai] += d*a0;
+			if (xbi == xai + 2) {
+				row[xai + 1] += d*(1 - a0 - am);
+			} else {
+				const float a1 = s*(1.5f - xaf);
+				row[xai + 1] += d*(a1 - a0);
+				for (int xi = xai + 2; xi < xbi - 1; ++xi)
+					row[xi] += d*s;
+				const float a2 = a1 + (xbi - xai - 3)*s;
+				row[xbi - 1] += d*(1 - a2 - am);
+			}
+			row[xbi] += d*am;
+			if (xbi > span->max)
+				span->max = xbi;
+		}
+		x = xnext;
+	}
+}
+
+/* Turn a row of accumulated areas (of a multiple of 4 length) into
+ * coverages, in place: prefix sums four pixels at a time, clamped to
+ * [0, 1] */
+static void accumulate(float *row, size_t n)
+{
+	const v4f zero = { 0 };
+	const v4f one = { 1, 1, 1, 1 };
+	v4f acc = zero;
+	for (size_t i = 0; i < n; i += 4) {
+		v4f x;
+		memcpy(&x, row + i, sizeof(x));
+		x += __builtin_shuffle(zero, x, (v4i){ 0, 4, 5, 6 });
+		x += __builtin_shuffle(zero, x, (v4i){ 0, 1, 4, 5 });
+		x += acc;
+		acc = __builtin_shuffle(x, (v4i){ 3, 3, 3, 3 });
+		x = (v4f)((v4i)x & 0x7fffffff);
+		const v4i below = x < one;
+		x = (v4f)(((v4i)x & below) | ((v4i)one & ~below));
+		memcpy(row + i, &x, sizeof(x));
+	}
+}
+
+static void blend(unsigned char *pixels, float const *cover, int n, float colour)
+{
+	for (int i = 0; i < n; ++i) {
+		const float p = pixels[i];
+		pixels[i] = p + (colour - p)*cover[i] + 0.5f;
+	}
+}
+
+/* Fill the polygons added so far with the given grey level, and forget
+ * them */
+static void fill(struct raster *r, float colour)
+{
+	if (!r->nlines)
+		return;
+
+	float minx = INFINITY, miny = INFINITY, maxx = -INFINITY, maxy = -INFINITY;
+	for (size_t i = 0; i < r->nlines; ++i) {
+		struct raster_line const *l = r->lines + i;
+		minx = fminf(minx, fminf(l->x0, l->x1));
+		maxx = fmaxf(maxx, fmaxf(l->x0, l->x1));
+		miny = fminf(miny, fminf(l->y0, l->y1));
+		maxy = fmaxf(maxy, fmaxf(l->y0, l->y1));
+	}
+
+	/* Rows are clipped to the image, but columns can't be, since the
+	 * coverage of a pixel depends on everything left of it. There's a
+	 * pixel of slack on each side for rounding errors */
+	const int x0 = floorf(minx) - 1, x1 = ceilf(maxx) + 1;
+	const int y0 = fmaxf(floorf(miny), 0), y1 = fminf(ceilf(maxy), r->size);
+	const int cx0 = x0 > 0 ? x0 : 0, cx1 = x1 < r->size ? x1 : r->size;
+	if (y0 >= y1 || cx0 >= cx1) {
+		r->nlines = 0;
+		return;
+	}
+
+	/* The coverage buffer is kept zeroed between primitives, by
+	 * clearing the spans of the rows once used, so only the cells near
+	 * the edges are visited on rows crossing a thin stroke */
+	const size_t stride = (size_t)(x1 - x0 + 1 + 3) & ~(size_t)3;
+	const size_t h = y1 - y0;
+	const size_t cover_cap = r->cover_cap;
+	r->cover = grow(r->cover, &r->cover_cap, stride*h, sizeof(*r->cover));
+	if (r->cover_cap != cover_cap)
+		memset(r->cover, 0, r->cover_cap*sizeof(*r->cover));
+	r->spans = grow(r->spans, &r->spans_cap, h, sizeof(*r->spans));
+	for (size_t y = 0; y < h; ++y) {
+		r->spans[y].min = INT_MAX;
+		r->spans[y].max = -1;
+	}
+	for (size_t i = 0; i < r->nlines; ++i) {
+		struct raster_line const *l = r->lines + i;
+		cover_line(r->cover, stride, r->spans, h,
+			l->x0 - x0, l->y0 - y0, l->x1 - x0, l->y1 - y0);
+	}
+	r->nlines = 0;
+
+	for (size_t y = 0; y < h; ++y) {
+		struct raster_span const *span = r->spans + y;
+		if (span->min > span->max)
+			continue;
+		/* Outside of the span, the coverage is 0 */
+		const int start = span->min & ~3;
+		const int end = (span->max + 4) & ~3;
+		float *row = r->cover + y*stride;
+		accumulate(row + start, end - start);
+		const int bx0 = x0 + start > cx0 ? x0 + start : cx0;
+		const int bx1 = x0 + end < cx1 ? x0 + end : cx1;
+		if (bx0 < bx1)
+			blend(r->pixels + (y0 + y)*r->size + bx0, row + (bx0 - x0),
+				bx1 - bx0, colour);
+		memset(row + start, 0, (end - start)*sizeof(*row));
+	}
+}
+
+/* Primitives */
+
+static float half_width(struct raster const *r, struct dl_prim const *prim)
+{
+	if (prim->stroke == DL_HAIRLINE)
+		return HAIRLINE_WIDTH*r->scale/2;
+	return prim->width*r->scale/2;
+}
+
+static float stroke_colour(struct dl_prim const *prim)
+{
+	return prim->stroke == DL_OVERSTROKE ? 255 : 0;
+}
+
+static void draw_circle(struct raster *r, struct dl_prim const *prim)
+{
+	const float h = half_width(r, prim);
+	if (h <= 0)
+		return;
+	const struct raster_point c = to_pixels(r, prim->circle.cx, prim->circle.cy);
+	const float radius = prim->circle.r*r->scale;
+	add_circle(r, c, radius + h, false);
+	if (radius > h)
+		add_circle(r, c, radius - h, true);
+	fill(r, stroke_colour(prim));
+}
+
+static void draw_path(struct raster *r, struct dl_prim const *prim)
+{
+	const float h = half_width(r, prim);
+	if (h <= 0 || !prim->npoints)
+		return;
+
+	const size_t n = prim->npoints;
+	size_t len = 0;
+	if (prim->op == DL_ARC_PATH) {
+		const float radius = prim->path.radius*r->scale;
+		for (size_t i = 0; i < n; ++i) {
+			struct dl_point const *a = prim->points + i;
+			struct dl_point const *b = prim->points + (i + 1) % n;
+			const struct raster_point pa = to_pixels(r, a->x, a->y);
+			push_point(r, &len, pa.x, pa.y);
+			push_arc(r, &len, pa, to_pixels(r, b->x, b->y), radius);
+		}
+		stroke_path(r, r->path, len, true, h);
+	} else {
+		/* Pieces are open, but for the last one */
+		size_t start = 0;
+		for (size_t i = 0; i < n; ++i) {
+			if (i && i < 16 && (prim->breaks >> i & 1)) {
+				stroke_path(r, r->path + start, len - start, false, h);
+				start = len;
+			}
+			const struct raster_point p =
+				to_pixels(r, prim->points[i].x, prim->points[i].y);
+			push_point(r, &len, p.x, p.y);
+		}
+		stroke_path(r, r->path + start, len - start, true, h);
+	}
+	fill(r, stroke_colour(prim));
+}
+
+void raster_render(struct raster *r, struct display_list const *dl)
+{
+	memset(r->pixels, 255, (size_t)r->size*r->size);
+	for (struct dl_prim const *prim = dl_next(dl, NULL); prim;
+		prim = dl_next(dl, prim)) {
+		switch (prim->op) {
+		case DL_CIRCLE:
+			draw_circle(r, prim);
+			break;
+		case DL_POLYLINE:
+		case DL_ARC_PATH:
+			draw_path(r, prim);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Encoders */
+
+/* Append n bytes to the buffer, returning where they go */
+static unsigned char *extend(char **data, size_t *len, size_t *cap, size_t n)
+{
+	*data = grow(*data, cap, *len + n, 1);
+	unsigned char *p = (unsigned char *)*data + *len;
+	*len += n;
+	return p;
+}
+
+void raster_ppm(struct raster const *r, char **data, size_t *len, size_t *cap)
+{
+	char header[32];
+	const int hlen = snprintf(header, sizeof(header), "P6\n%d %d\n255\n",
+		r->size, r->size);
+	memcpy(extend(data, len, cap, hlen), header, hlen);
+
+	const size_t npixels = (size_t)r->size*r->size;
+	unsigned char *rgb = extend(data, len, cap, 3*npixels);
+	for (size_t i = 0; i < npixels; ++i)
+		rgb[3*i] = rgb[3*i + 1] = rgb[3*i + 2] = r->pixels[i];
+}
+
+/* CRC-32 tables for 4 bytes at a time ("slicing-by-4"): crc_table[k][i]
+ * is the CRC of byte i followed by k zero bytes */
+static uint32_t crc_table[4][256];
+
+static void __attribute__((constructor)) init_crc_table(void)
+{
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; ++k)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[0][i] = c;
+	}
+	for (uint32_t i = 0; i < 256; ++i)
+		for (int k = 1; k < 4; ++k)
+			crc_table[k][i] = crc_table[0][crc_table[k-1][i] & 0xff] ^
+				crc_table[k-1][i] >> 8;
+}
+
+static uint32_t crc32(unsigned char const *p, size_t n)
+{
+	uint32_t c = 0xffffffff;
+	for (; n >= 4; n -= 4, p += 4) {
+		c ^= p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+		c = crc_table[3][c & 0xff] ^ crc_table[2][c >> 8 & 0xff] ^
+			crc_table[1][c >> 16 & 0xff] ^ crc_table[0][c >> 24];
+	}
+	while (n--)
+		c = crc_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+	return c ^ 0xffffffff;
+}
+
+static uint32_t adler32(uint32_t adler, unsigned char const *p, size_t n)
+{
+	uint32_t a = adler & 0xffff, b = adler >> 16;
+	while (n) {
+		/* Largest run that can't overflow b */
+		size_t k = n < 5552 ? n : 5552;
+		n -= k;
+		while (k--) {
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* Append a PNG chunk with n bytes of data, returning where the data goes.
+ * The CRC is appended by png_end_chunk() once the data is there */
+static unsigned char *png_chunk(char **data, size_t *len, size_t *cap,
+	const char *type, size_t n)
+{
+	unsigned char *p = extend(data, len, cap, 12 + n);
+	put32(p, n);
+	memcpy(p + 4, type, 4);
+	return p + 8;
+}
+
+static void png_end_chunk(unsigned char *body, size_t n)
+{
+	put32(body + n, crc32(body - 4, 4 + n));
+}
+
+/* Largest stored deflate block */
+#define STORED_BLOCK_SIZE 65535
+
+void raster_png(struct raster const *r, char **data, size_t *len, size_t *cap)
+{
+	static const unsigned char signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+	};
+	memcpy(extend(data, len, cap, sizeof(signature)), signature,
+		sizeof(signature));
+
+	unsigned char *ihdr = png_chunk(data, len, cap, "IHDR", 13);
+	put32(ihdr, r->size);
+	put32(ihdr + 4, r->size);
+	ihdr[8] = 8; /* bit depth */
+	ihdr[9] = 0; /* greyscale */
+	ihdr[10] = 0; /* deflate */
+	ihdr[11] = 0; /* no filtering */
+	ihdr[12] = 0; /* no interlacing */
+	png_end_chunk(ihdr, 13);
+
+	/* Each row is preceded by its filter type, 0 (none). The rows are
+	 * split in as many stored blocks as needed, in a zlib stream */
+	const size_t row = (size_t)r->size + 1;
+	const size_t raw = row*r->size;
+	const size_t nblocks = (raw + STORED_BLOCK_SIZE - 1)/STORED_BLOCK_SIZE;
+	const size_t zlen = 2 + 5*nblocks + raw + 4;
+	unsigned char *idat = png_chunk(data, len, cap, "IDAT", zlen);
+	unsigned char *p = idat;
+	*p++ = 0x78; /* deflate, 32KiB window */
+	*p++ = 0x01; /* no compression, check bits */
+	uint32_t adler = 1;
+	size_t pos = 0;
+	while (pos < raw) {
+		const size_t block = raw - pos < STORED_BLOCK_SIZE ?
+			raw - pos : STORED_BLOCK_SIZE;
+		*p++ = pos + block == raw; /* BFINAL, BTYPE 00 */
+		*p++ = block;
+		*p++ = block >> 8;
+		*p++ = ~block;
+		*p++ = ~block >> 8;
+		const size_t end = pos + block;
+		while (pos < end) {
+			const size_t y = pos/row, x = pos%row;
+			unsigned char const *src;
+			size_t n;
+			if (x == 0) {
+				static const unsigned char filter = 0;
+				src = &filter;
+				n = 1;
+			} else {
+				src = r->pixels + y*r->size + x - 1;
+				n = row - x < end - pos ? row - x : end - pos;
+			}
+			memcpy(p, src, n);
+			adler = adler32(adler, src, n);
+			p += n;
+			pos += n;
+		}
+	}
+	put32(p, adler);
+	png_end_chunk(idat, zlen);
+
+	png_end_chunk(png_chunk(data, len, cap, "IEND", 0), 0);
+}
@@ -0,0 +1,62 @@
+/* Anti-aliased rasterizer for display lists.
+ *
+ * Draws the circles, polylines and arc paths of a display list (see
+ * display-list.h) into a square greyscale image, with the stroke rules
+ * of SVG: butt caps, miter joins (with the default miter limit of 4),
+ * understrokes in black and overstrokes in white, on a white background.
+ *
+ * Each primitive is turned into a set of polygons (the outline of its
+ * stroke), whose edges are accumulated as signed areas into a coverage
+ * buffer over the bounding box of the primitive; the coverage of each
+ * pixel is then the prefix sum of its row, which is used to blend the
+ * stroke colour into the image. This gives exact area coverage, with no
+ * supersampling.
+ *
+ * The image can be encoded as a binary PPM, or as a PNG with stored
+ * (uncompressed) deflate blocks, so that no compression library is needed.
+ */
+
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <stddef.h>
+
+#include "display-list.h"
+
+struct raster_line;
+struct raster_point;
+struct raster_span;
+
+struct raster {
+	int size; /* width and height of the image, in pixels */
+	float scale; /* pixels per drawing unit */
+	float origin; /* drawing coordinates of the top left corner */
+	unsigned char *pixels; /* size*size grey levels, row by row */
+
+	/* Scratch space for the primitive being drawn */
+	struct raster_line *lines;
+	size_t nlines;
+	size_t lines_cap;
+	struct raster_point *path;
+	size_t path_cap;
+	float *cover;
+	size_t cover_cap;
+	struct raster_span *spans;
+	size_t spans_cap;
+};
+
+/* Initialize an image of size by size pixels, showing the square of the
+ * drawing from (origin, origin) to (origin + extent, origin + extent) */
+void raster_init(struct raster *r, int size, float origin, float extent);
+
+/* Draw the display list over a blank image */
+void raster_render(struct raster *r, struct display_list const *dl);
+
+void raster_free(struct raster *r);
+
+/* Encoders: append the image to the buffer *data, holding *len bytes out
+ * of *cap, which is grown with realloc() as needed */
+void raster_ppm(struct raster const *r, char **data, size_t *len, size_t *cap);
+void raster_png(struct raster const *r, char **data, size_t *len, size_t *cap);
+
+#endif
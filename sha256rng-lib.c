@@ -0,0 +1,493 @@
+/* SHA256-based pseudo-random number generator, see sha256rng.h */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sha256rng.h"
+
+typedef unsigned char uchar;
+
+static const size_t min_sz = SHA256_DIGEST_LENGTH;
+
+/* The pool is a ring buffer of pool_cap bytes (a power of two). The
+ * positions pool_base (start of the pool), pool_use (end of the pool) and
+ * pool_cursor (next byte to return) are absolute stream positions, the
+ * byte at position p being at pool[p & (pool_cap - 1)].
+ *
+ * The legacy generator was originally implemented on a linear buffer,
+ * enlarged by a digest whenever another digest wouldn't fit, and shifted
+ * back to start from the cursor as soon as this went past half the buffer.
+ * Since the hash of the whole pool depends on where it was last shifted,
+ * we still track the size the linear buffer would have (pool_size) to
+ * know when to move the pool base, but moving it costs nothing now.
+ */
+
+/* Smallest ring buffer: this is enough to never grow the ring while
+ * generating, unless the generator was seeded with lots of seeds */
+#define MIN_POOL_CAP (4*SHA256_DIGEST_LENGTH)
+
+/* Copy n bytes from the ring, starting from (absolute) position pos */
+static void ring_read(struct sha256rng const *rng, uint64_t pos, uchar *dst, size_t n)
+{
+	const size_t start = pos & (rng->pool_cap - 1);
+	const size_t head = rng->pool_cap - start < n ? rng->pool_cap - start : n;
+	memcpy(dst, rng->pool + start, head);
+	memcpy(dst + head, rng->pool, n - head);
+}
+
+/* Copy n bytes into the ring, starting from (absolute) position pos */
+static void ring_write(struct sha256rng *rng, uint64_t pos, const uchar *src, size_t n)
+{
+	const size_t start = pos & (rng->pool_cap - 1);
+	const size_t head = rng->pool_cap - start < n ? rng->pool_cap - start : n;
+	memcpy(rng->pool + start, src, head);
+	memcpy(rng->pool, src + head, n - head);
+}
+
+/* Hash the pool, i.e. the (at most two) segments of the ring between
+ * pool_base and pool_use */
+static void hash_pool(struct sha256rng const *rng, uchar *out)
+{
+	SHA256_CTX ctx;
+	SHA256_Init(&ctx);
+	if (rng->pool_use > rng->pool_base) {
+		const size_t n = rng->pool_use - rng->pool_base;
+		const size_t start = rng->pool_base & (rng->pool_cap - 1);
+		const size_t head = rng->pool_cap - start < n ? rng->pool_cap - start : n;
+		SHA256_Update(&ctx, rng->pool + start, head);
+		SHA256_Update(&ctx, rng->pool, n - head);
+	}
+	SHA256_Final(out, &ctx);
+}
+
+/* Grow the ring to (at least) the given capacity */
+static void grow_ring(struct sha256rng *rng, size_t cap)
+{
+	size_t new_cap = rng->pool_cap ? rng->pool_cap : MIN_POOL_CAP;
+	while (new_cap < cap)
+	{
+		if (new_cap > SIZE_MAX/2)
+		{
+			fprintf(stderr, "out of size");
+			abort();
+		}
+		new_cap *= 2;
+	}
+	uchar *pnew = malloc(new_cap);
+	if (pnew == NULL)
+	{
+		fprintf(stderr, "out of memory");
+		abort();
+	}
+	/* Move the pool contents to the same absolute positions
+	 * in the new ring */
+	const uint64_t len = rng->pool_use - rng->pool_base;
+	for (uint64_t done = 0; done < len; ) {
+		const uint64_t pos = rng->pool_base + done;
+		const size_t start = pos & (new_cap - 1);
+		size_t chunk = new_cap - start;
+		if (len - done < chunk)
+			chunk = len - done;
+		ring_read(rng, pos, pnew + start, chunk);
+		done += chunk;
+	}
+	free(rng->pool);
+	rng->pool = pnew;
+	rng->pool_cap = new_cap;
+}
+
+/* Make sure the pool has room for at least another digest */
+static void prepare_pool(struct sha256rng *rng)
+{
+	/* If we have enough room for another hash, do nothing */
+	if (rng->pool_size - (rng->pool_use - rng->pool_base) > min_sz)
+		return;
+	/* We need to enlarge the pool; first make sure there is room */
+	if (SIZE_MAX - min_sz < rng->pool_size)
+	{
+		fprintf(stderr, "out of size");
+		abort();
+	}
+	rng->pool_size += min_sz;
+	if (rng->pool_size > rng->pool_cap)
+		grow_ring(rng, rng->pool_size);
+}
+
+/* Add the pool hash to the pool itself */
+static void repool(struct sha256rng *rng)
+{
+	uchar digest[SHA256_DIGEST_LENGTH];
+#ifdef DEBUG
+	fputs("repooling\n", stderr);
+#endif
+	prepare_pool(rng);
+	hash_pool(rng, digest);
+	ring_write(rng, rng->pool_use, digest, sizeof(digest));
+	rng->pool_use += min_sz;
+}
+
+/* Move the pool base to the cursor, which is what shifting the linear
+ * pool to start from the cursor amounted to */
+static void shift_pool(struct sha256rng *rng)
+{
+#ifdef DEBUG
+	fprintf(stderr, "shift: %zu %zu %zu\n",
+		(size_t)(rng->pool_cursor - rng->pool_base),
+		(size_t)(rng->pool_use - rng->pool_base),
+		rng->pool_size);
+#endif
+	rng->pool_base = rng->pool_cursor;
+}
+
+/* Derive the counter mode key from the seed pool */
+static void rekey(struct sha256rng *rng)
+{
+	uchar key[SHA256_DIGEST_LENGTH];
+	hash_pool(rng, key);
+	SHA256_Init(&rng->base);
+	SHA256_Update(&rng->base, key, sizeof(key));
+}
+
+void sha256rng_init(struct sha256rng *rng, enum sha256rng_mode mode)
+{
+	memset(rng, 0, sizeof(*rng));
+	rng->mode = mode;
+	rng->cursor = sizeof(rng->out);
+	rekey(rng);
+}
+
+void sha256rng_seed(struct sha256rng *rng, const void *data, size_t len)
+{
+#ifdef DEBUG
+	fprintf(stderr, "pooling %zu bytes", len);
+#endif
+	uchar digest[SHA256_DIGEST_LENGTH];
+	SHA256(data, len, digest);
+	sha256rng_seed_digest(rng, digest);
+}
+
+/* Regular files are hashed by mapping windows of this size, other files
+ * (and whatever can't be mapped) by reading chunks of this size */
+#define SEED_WINDOW (64UL << 20)
+#define SEED_CHUNK (1UL << 20)
+
+int sha256rng_seed_fd(struct sha256rng *rng, int fd)
+{
+	SHA256_CTX ctx;
+	uchar digest[SHA256_DIGEST_LENGTH];
+	struct stat st;
+
+	SHA256_Init(&ctx);
+	if (fstat(fd, &st))
+		return -1;
+
+	/* Map the regular file from the current offset to its (reported)
+	 * end, then leave the offset there, as reading would. Files
+	 * reporting no size (as in procfs and sysfs) may still have
+	 * contents, and a mapping may fail, so whatever is left is read
+	 * below in any case */
+	off_t pos;
+	if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+		(pos = lseek(fd, 0, SEEK_CUR)) >= 0) {
+		const off_t page = sysconf(_SC_PAGESIZE);
+		while (pos < st.st_size) {
+			const off_t base = pos - pos % page;
+			const size_t len = st.st_size - base < (off_t)SEED_WINDOW ?
+				(size_t)(st.st_size - base) : SEED_WINDOW;
+			uchar *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, base);
+			if (map == MAP_FAILED)
+				break;
+			madvise(map, len, MADV_SEQUENTIAL);
+			SHA256_Update(&ctx, map + (pos - base), len - (pos - base));
+			munmap(map, len);
+			pos = base + len;
+		}
+		if (lseek(fd, pos, SEEK_SET) < 0)
+			return -1;
+	}
+
+	uchar *buf = malloc(SEED_CHUNK);
+	if (buf == NULL)
+		return -1;
+	for (;;) {
+		const ssize_t r = read(fd, buf, SEED_CHUNK);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			const int err = errno;
+			free(buf);
+			errno = err;
+			return -1;
+		}
+		if (!r)
+			break;
+		SHA256_Update(&ctx, buf, r);
+	}
+	free(buf);
+
+	SHA256_Final(digest, &ctx);
+	sha256rng_seed_digest(rng, digest);
+	return 0;
+}
+
+void sha256rng_seed_digest(struct sha256rng *rng,
+	const unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+	prepare_pool(rng);
+	ring_write(rng, rng->pool_use, digest, min_sz);
+	rng->pool_use += min_sz;
+	/* The key is kept up to date so that sha256rng_fill_at() needs not
+	 * modify the generator */
+	rekey(rng);
+}
+
+/* Compute the given block of the counter mode stream */
+static void counter_block(struct sha256rng const *rng, uint64_t block, uchar *out)
+{
+	uchar ctr[16];
+	for (size_t i = 0; i < 8; ++i)
+		ctr[i] = block >> (8*i);
+	for (size_t i = 0; i < 8; ++i)
+		ctr[8 + i] = rng->stream_id >> (8*i);
+
+	SHA256_CTX ctx = rng->base;
+	SHA256_Update(&ctx, ctr, rng->substream ? 16 : 8);
+	SHA256_Final(out, &ctx);
+}
+
+int sha256rng_stream(struct sha256rng *rng, uint64_t k)
+{
+	if (rng->mode != SHA256RNG_COUNTER)
+		return -1;
+	rng->substream = true;
+	rng->stream_id = k;
+	return sha256rng_seek(rng, 0);
+}
+
+int sha256rng_split(struct sha256rng *dst, struct sha256rng const *src,
+	uint64_t k)
+{
+	if (src->mode != SHA256RNG_COUNTER)
+		return -1;
+	*dst = *src;
+	/* The copy gets its own pool, so that it can be freed (or seeded)
+	 * independently */
+	if (src->pool) {
+		dst->pool = malloc(src->pool_cap);
+		if (dst->pool == NULL)
+		{
+			fprintf(stderr, "out of memory");
+			abort();
+		}
+		memcpy(dst->pool, src->pool, src->pool_cap);
+	}
+	return sha256rng_stream(dst, k);
+}
+
+int sha256rng_seek(struct sha256rng *rng, uint64_t offset)
+{
+	if (rng->mode != SHA256RNG_COUNTER)
+		return -1;
+
+	rng->block = offset / sizeof(rng->out);
+	rng->cursor = offset % sizeof(rng->out);
+	if (rng->cursor)
+		counter_block(rng, rng->block++, rng->out);
+	else
+		rng->cursor = sizeof(rng->out);
+	return 0;
+}
+
+/* Fill buf with n bytes from the pool, enlarging the pool if necessary.
+ * This produces the same stream as consuming the pool one byte at a time,
+ * repooling whenever less than a digest is left ahead of the cursor, and
+ * shifting as soon as the cursor goes past half the pool: we just copy
+ * as much as we can before either happens. */
+static void fill_legacy(struct sha256rng *rng, uchar *buf, size_t n)
+{
+	/* Without seeds, the pool starts with the hash of nothing */
+	if (rng->pool_use == rng->pool_base)
+		repool(rng);
+
+	while (n) {
+		if (rng->pool_use - rng->pool_cursor < min_sz)
+			repool(rng);
+		const uint64_t shift_at = rng->pool_base + rng->pool_size/2 + 1;
+		size_t chunk = rng->pool_use - rng->pool_cursor - (min_sz - 1);
+		if (shift_at - rng->pool_cursor < chunk)
+			chunk = shift_at - rng->pool_cursor;
+		if (n < chunk)
+			chunk = n;
+		ring_read(rng, rng->pool_cursor, buf, chunk);
+		rng->pool_cursor += chunk;
+		buf += chunk;
+		n -= chunk;
+		if (rng->pool_cursor == shift_at)
+			shift_pool(rng);
+	}
+}
+
+/* Fill buf with n bytes in counter mode. Whole blocks are hashed straight
+ * into the buffer, a trailing partial block is kept for the next call */
+static void fill_counter(struct sha256rng *rng, uchar *buf, size_t n)
+{
+	const size_t left = sizeof(rng->out) - rng->cursor;
+	const size_t head = n < left ? n : left;
+	memcpy(buf, rng->out + rng->cursor, head);
+	rng->cursor += head;
+	buf += head;
+	n -= head;
+
+	for (; n >= sizeof(rng->out); n -= sizeof(rng->out), buf += sizeof(rng->out))
+		counter_block(rng, rng->block++, buf);
+
+	if (n) {
+		counter_block(rng, rng->block++, rng->out);
+		memcpy(buf, rng->out, n);
+		rng->cursor = n;
+	}
+}
+
+void sha256rng_fill(struct sha256rng *rng, void *buf, size_t n)
+{
+	if (rng->mode == SHA256RNG_LEGACY)
+		fill_legacy(rng, buf, n);
+	else
+		fill_counter(rng, buf, n);
+}
+
+void sha256rng_fill_at(struct sha256rng const *rng, uint64_t offset,
+	void *dst, size_t n)
+{
+	uchar *buf = dst;
+	uchar tmp[SHA256_DIGEST_LENGTH];
+	uint64_t block = offset / sizeof(tmp);
+	const size_t skip = offset % sizeof(tmp);
+
+	if (skip && n) {
+		const size_t head = n < sizeof(tmp) - skip ? n : sizeof(tmp) - skip;
+		counter_block(rng, block++, tmp);
+		memcpy(buf, tmp + skip, head);
+		buf += head;
+		n -= head;
+	}
+
+	for (; n >= sizeof(tmp); n -= sizeof(tmp), buf += sizeof(tmp))
+		counter_block(rng, block++, buf);
+
+	if (n) {
+		counter_block(rng, block, tmp);
+		memcpy(buf, tmp, n);
+	}
+}
+
+/* Bring n little-endian words to host order */
+static void le32_to_host(uint32_t *v, size_t n)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (size_t i = 0; i < n; ++i)
+		v[i] = __builtin_bswap32(v[i]);
+#else
+	(void)v; (void)n;
+#endif
+}
+
+static void le64_to_host(uint64_t *v, size_t n)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (size_t i = 0; i < n; ++i)
+		v[i] = __builtin_bswap64(v[i]);
+#else
+	(void)v; (void)n;
+#endif
+}
+
+void sha256rng_u32(struct sha256rng *rng, uint32_t *out, size_t n)
+{
+	sha256rng_fill(rng, out, n*sizeof(*out));
+	le32_to_host(out, n);
+}
+
+void sha256rng_u64(struct sha256rng *rng, uint64_t *out, size_t n)
+{
+	sha256rng_fill(rng, out, n*sizeof(*out));
+	le64_to_host(out, n);
+}
+
+/* Doubles are converted from batches of this many 64-bit integers */
+#define DOUBLE_BATCH 1024
+
+void sha256rng_double(struct sha256rng *rng, double *out, size_t n)
+{
+	uint64_t raw[DOUBLE_BATCH];
+	while (n) {
+		const size_t batch = n < DOUBLE_BATCH ? n : DOUBLE_BATCH;
+		sha256rng_u64(rng, raw, batch);
+		for (size_t i = 0; i < batch; ++i)
+			out[i] = (raw[i] >> 11) * 0x1.0p-53;
+		out += batch;
+		n -= batch;
+	}
+}
+
+/* Candidates are drawn at most this many at a time. We only ever draw as
+ * many as the values still missing, so that the values only depend on the
+ * stream, and not on how they were split among calls */
+#define RANGE_BATCH 1024
+
+void sha256rng_range(struct sha256rng *rng, int64_t lo, int64_t hi,
+	int64_t *out, size_t n)
+{
+	const uint64_t span = (uint64_t)hi - (uint64_t)lo;
+
+	if (span <= UINT32_MAX) {
+		/* Candidates x are mapped to (x*span) >> 32, rejecting
+		 * those whose low half is below 2^32 mod span */
+		const uint32_t s = span;
+		const uint32_t threshold = -s % s;
+		uint32_t cand[RANGE_BATCH];
+		while (n) {
+			const size_t batch = n < RANGE_BATCH ? n : RANGE_BATCH;
+			sha256rng_u32(rng, cand, batch);
+			for (size_t i = 0; i < batch; ++i) {
+				const uint64_t m = (uint64_t)cand[i]*s;
+				if ((uint32_t)m < threshold)
+					continue;
+				*out++ = (uint64_t)lo + (m >> 32);
+				--n;
+			}
+		}
+	} else {
+		/* Same thing with 64-bit candidates */
+		const uint64_t threshold = -span % span;
+		uint64_t cand[RANGE_BATCH];
+		while (n) {
+			const size_t batch = n < RANGE_BATCH ? n : RANGE_BATCH;
+			sha256rng_u64(rng, cand, batch);
+			for (size_t i = 0; i < batch; ++i) {
+				const unsigned __int128 m = (unsigned __int128)cand[i]*span;
+				if ((uint64_t)m < threshold)
+					continue;
+				*out++ = (uint64_t)lo + (uint64_t)(m >> 64);
+				--n;
+			}
+		}
+	}
+}
+
+void sha256rng_free(struct sha256rng *rng)
+{
+	free(rng->pool);
+	rng->pool = NULL;
+	rng->pool_cap = rng->pool_size = 0;
+	rng->pool_base = rng->pool_use = rng->pool_cursor = 0;
+}
@@ -1,112 +1,1361 @@
 /* Pseudo-random number generator that uses SHA256 hashing to produce
  * random byte. Starting from an initial (possibly empty) seed(s), it
- * generates new bytes by hashing the pool so far.
+ * generates new bytes either:
+ * (counter mode, the default) by hashing a key derived from the seeds
+ * followed by a 64-bit block counter, which costs a single (short) hash
+ * per 32 bytes of output, or
+ * (legacy mode) by hashing the pool so far, which is what the first
+ * versions of the generator did, and is kept to reproduce old streams.
+ *
+ * This is the command-line interface, the generator itself is in
+ * sha256rng-lib.c.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include <math.h>
+#include <time.h>
 
-#include <openssl/sha.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
+
+#include "sha256rng.h"
 
 typedef unsigned char uchar;
 
-uchar *pool;
-size_t pool_size;
-size_t pool_use;
-size_t pool_cursor;
-static const size_t min_sz = SHA256_DIGEST_LENGTH;
+/* Size of the output buffer: the stream is produced and written
+ * in chunks of this size */
+#define OUTBUF_SIZE (1U << 20)
 
-/* Make sure the pool has room for at least another digest */
-void prepare_pool()
+/* Write all of buf to fd, bailing out on errors */
+void write_all(int fd, const uchar *buf, size_t n)
 {
-	/* If we have enough room for another hash, do nothing */
-	if (pool_size - pool_use > min_sz)
-		return;
-	/* We need to enlarge the pool; first make sure there is room */
-	if (SIZE_MAX - min_sz < pool_size)
+	while (n) {
+		ssize_t w = write(fd, buf, n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			exit(1);
+		}
+		buf += w;
+		n -= w;
+	}
+}
+
+/* Parse a byte count, with an optional K/M/G/T (binary) suffix */
+static unsigned long long parse_size(const char *arg, const char *what)
+{
+	char *end;
+	errno = 0;
+	unsigned long long val = strtoull(arg, &end, 0);
+	int shift = 0;
+	switch (*end) {
+	case 'k': case 'K': shift = 10; ++end; break;
+	case 'm': case 'M': shift = 20; ++end; break;
+	case 'g': case 'G': shift = 30; ++end; break;
+	case 't': case 'T': shift = 40; ++end; break;
+	}
+	if (errno || end == arg || *end || *arg == '-' ||
+		val > (ULLONG_MAX >> shift)) {
+		fprintf(stderr, "invalid %s '%s'\n", what, arg);
+		exit(1);
+	}
+	return val << shift;
+}
+
+/* Multi-threaded counter mode generation: chunk k of the output (i.e. the
+ * OUTBUF_SIZE bytes starting at offset + k*OUTBUF_SIZE) is produced by
+ * whichever worker grabs it first into slot k % nslots, and the main
+ * thread writes out the slots in order */
+enum slot_state { SLOT_FREE, SLOT_BUSY, SLOT_READY };
+
+struct parallel_gen {
+	struct sha256rng const *rng;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t offset; /* stream offset of the first chunk */
+	unsigned long long limit; /* total bytes to produce */
+	unsigned long long next_chunk; /* next chunk to be grabbed by a worker */
+	size_t nslots;
+	struct {
+		uchar *buf;
+		size_t len;
+		enum slot_state state;
+	} *slots;
+};
+
+/* Size of chunk k, or 0 if we are past the limit */
+static size_t chunk_size(struct parallel_gen const *gen, unsigned long long k)
+{
+	if (k >= gen->limit/OUTBUF_SIZE)
+		return k == gen->limit/OUTBUF_SIZE ? gen->limit % OUTBUF_SIZE : 0;
+	return OUTBUF_SIZE;
+}
+
+static void *parallel_worker(void *arg)
+{
+	struct parallel_gen *gen = arg;
+
+	pthread_mutex_lock(&gen->lock);
+	for (;;) {
+		const unsigned long long k = gen->next_chunk;
+		const size_t len = chunk_size(gen, k);
+		if (!len)
+			break;
+		++gen->next_chunk;
+
+		/* Wait for the writer to be done with the previous
+		 * contents of the slot */
+		const size_t s = k % gen->nslots;
+		while (gen->slots[s].state != SLOT_FREE)
+			pthread_cond_wait(&gen->cond, &gen->lock);
+		gen->slots[s].state = SLOT_BUSY;
+		pthread_mutex_unlock(&gen->lock);
+
+		sha256rng_fill_at(gen->rng, gen->offset + k*OUTBUF_SIZE,
+			gen->slots[s].buf, len);
+
+		pthread_mutex_lock(&gen->lock);
+		gen->slots[s].len = len;
+		gen->slots[s].state = SLOT_READY;
+		pthread_cond_broadcast(&gen->cond);
+	}
+	pthread_mutex_unlock(&gen->lock);
+	return NULL;
+}
+
+void generate_parallel(struct sha256rng const *rng, uint64_t offset,
+	unsigned long long limit, int nthreads)
+{
+	struct parallel_gen gen = {
+		.rng = rng,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.offset = offset,
+		.limit = limit,
+		.nslots = 2*nthreads,
+	};
+	pthread_t *threads = calloc(nthreads, sizeof(*threads));
+	gen.slots = calloc(gen.nslots, sizeof(*gen.slots));
+	if (threads == NULL || gen.slots == NULL)
 	{
-		fprintf(stderr, "out of size");
+		fprintf(stderr, "out of memory");
+		abort();
+	}
+	for (size_t s = 0; s < gen.nslots; ++s) {
+		gen.slots[s].buf = malloc(OUTBUF_SIZE);
+		if (gen.slots[s].buf == NULL)
+		{
+			fprintf(stderr, "out of memory");
+			abort();
+		}
+	}
+
+	for (int t = 0; t < nthreads; ++t) {
+		if (pthread_create(threads + t, NULL, parallel_worker, &gen)) {
+			fprintf(stderr, "failed to create worker thread\n");
+			abort();
+		}
+	}
+
+	for (unsigned long long k = 0; chunk_size(&gen, k); ++k) {
+		const size_t s = k % gen.nslots;
+		pthread_mutex_lock(&gen.lock);
+		while (gen.slots[s].state != SLOT_READY)
+			pthread_cond_wait(&gen.cond, &gen.lock);
+		pthread_mutex_unlock(&gen.lock);
+
+		write_all(STDOUT_FILENO, gen.slots[s].buf, gen.slots[s].len);
+
+		pthread_mutex_lock(&gen.lock);
+		gen.slots[s].state = SLOT_FREE;
+		pthread_cond_broadcast(&gen.cond);
+		pthread_mutex_unlock(&gen.lock);
+	}
+
+	for (int t = 0; t < nthreads; ++t)
+		pthread_join(threads[t], NULL);
+	for (size_t s = 0; s < gen.nslots; ++s)
+		free(gen.slots[s].buf);
+	free(gen.slots);
+	free(threads);
+}
+
+/* Pipelined generation: a generator thread fills the output buffers
+ * while the main thread writes them out, so that hashing overlaps I/O.
+ * Buffers are handed over in both directions through lock-free
+ * single-producer/single-consumer queues */
+#define PIPELINE_BUFS 4
+
+struct spsc_queue {
+	unsigned head; /* next item to pop, only written by the consumer */
+	unsigned tail; /* next item to push, only written by the producer */
+	unsigned waiting; /* whether the consumer (may) sleep on tail */
+	struct {
+		uchar *buf;
+		size_t len;
+	} items[PIPELINE_BUFS];
+};
+
+static long futex(unsigned *addr, int op, unsigned val)
+{
+	return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+/* There are only PIPELINE_BUFS buffers around, so pushing never has to
+ * wait for room */
+static void spsc_push(struct spsc_queue *q, uchar *buf, size_t len)
+{
+	const unsigned tail = q->tail;
+	q->items[tail % PIPELINE_BUFS].buf = buf;
+	q->items[tail % PIPELINE_BUFS].len = len;
+	/* Sequentially consistent, against the store to waiting and the
+	 * load of tail in spsc_pop(): either we see the consumer waiting,
+	 * or it sees the new tail */
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST))
+		futex(&q->tail, FUTEX_WAKE_PRIVATE, 1);
+}
+
+/* Wait for an item: spin for a while, then sleep until the producer
+ * wakes us up, so that we don't keep a core busy (or keep waking up) if
+ * the other side is much slower, e.g. stalled on its output */
+static uchar *spsc_pop(struct spsc_queue *q, size_t *len)
+{
+	const unsigned head = q->head;
+	for (unsigned spins = 0; __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == head; ++spins) {
+		if (spins < 64)
+			continue;
+		__atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+		/* Only sleeps if tail is still head, so a push between the
+		 * check above and here isn't missed */
+		if (__atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) == head)
+			futex(&q->tail, FUTEX_WAIT_PRIVATE, head);
+		__atomic_store_n(&q->waiting, 0, __ATOMIC_RELAXED);
+	}
+	uchar *buf = q->items[head % PIPELINE_BUFS].buf;
+	*len = q->items[head % PIPELINE_BUFS].len;
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return buf;
+}
+
+struct pipeline {
+	struct sha256rng *rng;
+	unsigned long long limit;
+	struct spsc_queue free_bufs; /* writer -> generator */
+	struct spsc_queue full_bufs; /* generator -> writer */
+};
+
+static void *pipeline_generator(void *arg)
+{
+	struct pipeline *pl = arg;
+	unsigned long long limit = pl->limit;
+	size_t len;
+	for (;;) {
+		uchar *buf = spsc_pop(&pl->free_bufs, &len);
+		const size_t chunk = limit < OUTBUF_SIZE ? limit : OUTBUF_SIZE;
+		sha256rng_fill(pl->rng, buf, chunk);
+		/* An empty buffer marks the end of the stream */
+		spsc_push(&pl->full_bufs, buf, chunk);
+		if (!chunk)
+			break;
+		if (limit != ULLONG_MAX)
+			limit -= chunk;
+	}
+	return NULL;
+}
+
+/* Zero-copy output: when writing to a pipe, the output buffers can be
+ * handed to the kernel with vmsplice() rather than copied with write().
+ * The catch is that the pages are then referenced by the pipe, so a buffer
+ * cannot be refilled until the reader has consumed it. Since the pipe
+ * holds at most its capacity, once a further `holdback` buffers' worth of
+ * data (at least as much as the pipe capacity) has been spliced in after
+ * a buffer, that buffer is guaranteed to be out of the pipe.
+ *
+ * This assumes that the reader actually reads from the pipe, rather than
+ * splicing or teeing the pages somewhere else.
+ *
+ * Returns the number of buffers to hold back, or 0 if vmsplice() can't
+ * be used on fd */
+static unsigned setup_zero_copy(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) || !S_ISFIFO(st.st_mode))
+		return 0;
+	/* Try to make the pipe as large as an output buffer, it's fine if
+	 * we can't */
+	fcntl(fd, F_SETPIPE_SZ, OUTBUF_SIZE);
+	const int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+	if (pipe_size <= 0)
+		return 0;
+	const unsigned holdback = (pipe_size + OUTBUF_SIZE - 1)/OUTBUF_SIZE;
+	/* We need at least two buffers in flight besides the held back ones,
+	 * one being generated and one being spliced */
+	if (holdback + 2 > PIPELINE_BUFS)
+		return 0;
+	return holdback;
+}
+
+/* Splice as much of buf as possible into the pipe fd. Returns how much
+ * was spliced, which is less than n if vmsplice() is not usable */
+static size_t vmsplice_all(int fd, uchar *buf, size_t n)
+{
+	size_t spliced = 0;
+	while (spliced < n) {
+		struct iovec iov = { .iov_base = buf + spliced,
+			.iov_len = n - spliced };
+		ssize_t w = vmsplice(fd, &iov, 1, 0);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EPIPE)
+				break;
+			perror("vmsplice");
+			exit(1);
+		}
+		spliced += w;
+	}
+	return spliced;
+}
+
+/* Write out the stream through the generator thread. With zero_copy,
+ * use vmsplice() if fd is a pipe */
+void generate_pipelined(struct sha256rng *rng, int fd, unsigned long long limit,
+	bool zero_copy)
+{
+	struct pipeline pl = { .rng = rng, .limit = limit };
+	uchar *bufs[PIPELINE_BUFS];
+	const size_t page = sysconf(_SC_PAGESIZE);
+	for (int b = 0; b < PIPELINE_BUFS; ++b) {
+		/* Page-aligned, so that vmsplice() can move whole pages */
+		if (posix_memalign((void **)(bufs + b), page, OUTBUF_SIZE))
+		{
+			fprintf(stderr, "out of memory");
+			abort();
+		}
+		spsc_push(&pl.free_bufs, bufs[b], 0);
+	}
+
+	unsigned holdback = zero_copy ? setup_zero_copy(fd) : 0;
+	bool splice = holdback;
+	uchar *held[PIPELINE_BUFS];
+	unsigned nheld = 0;
+
+	pthread_t generator;
+	if (pthread_create(&generator, NULL, pipeline_generator, &pl)) {
+		fprintf(stderr, "failed to create generator thread\n");
 		abort();
 	}
-	size_t increment = pool_size ? min_sz : min_sz*min_sz;
-	while (increment < pool_size && SIZE_MAX - increment < pool_size)
+
+	size_t len;
+	uchar *buf;
+	while ((buf = spsc_pop(&pl.full_bufs, &len), len)) {
+		const size_t spliced = splice ? vmsplice_all(fd, buf, len) : 0;
+		if (spliced < len) {
+			/* Fall back to write() for good. The buffers spliced
+			 * so far may still be in the pipe, so they are released
+			 * as before, once enough data has been written after
+			 * them (the written buffers are just counted in, by
+			 * holding them back too); if nothing was spliced at
+			 * all, there's nothing to wait for */
+			if (splice && !nheld && !spliced)
+				holdback = 0;
+			splice = false;
+			write_all(fd, buf + spliced, len - spliced);
+		}
+		if (!holdback) {
+			spsc_push(&pl.free_bufs, buf, 0);
+			continue;
+		}
+		held[nheld++] = buf;
+		if (nheld > holdback) {
+			spsc_push(&pl.free_bufs, held[0], 0);
+			memmove(held, held + 1, --nheld*sizeof(*held));
+		}
+	}
+
+	pthread_join(generator, NULL);
+	for (int b = 0; b < PIPELINE_BUFS; ++b)
+		free(bufs[b]);
+}
+
+/* Direct-to-file generation: the output file is preallocated to its
+ * final size and mapped, and the workers generate their chunks straight
+ * into the mapping, so the data is never copied. Chunks are larger than
+ * the output buffers, so that the workers rarely have to synchronise */
+#define FILE_CHUNK_SIZE (64U << 20)
+
+struct file_gen {
+	struct sha256rng const *rng;
+	uchar *map;
+	uint64_t offset; /* stream offset of the start of the file */
+	unsigned long long size;
+	unsigned long long next_chunk; /* atomic */
+};
+
+static void *file_worker(void *arg)
+{
+	struct file_gen *gen = arg;
+	const unsigned long long nchunks =
+		(gen->size + FILE_CHUNK_SIZE - 1)/FILE_CHUNK_SIZE;
+	unsigned long long k;
+	while ((k = __atomic_fetch_add(&gen->next_chunk, 1, __ATOMIC_RELAXED))
+		< nchunks) {
+		const unsigned long long start = k*FILE_CHUNK_SIZE;
+		const size_t len = gen->size - start < FILE_CHUNK_SIZE ?
+			gen->size - start : FILE_CHUNK_SIZE;
+		sha256rng_fill_at(gen->rng, gen->offset + start,
+			gen->map + start, len);
+	}
+	return NULL;
+}
+
+/* Write size bytes of the (counter mode) stream, starting from the given
+ * offset, to the file at path, with nthreads threads. Returns 0 on success,
+ * -1 on failure, after reporting the error */
+int generate_to_file(struct sha256rng const *rng, const char *path,
+	uint64_t offset, unsigned long long size, int nthreads, bool hugepages)
+{
+	/* Before truncating anything */
+	if ((off_t)size < 0 || (size_t)size != size) {
+		fprintf(stderr, "%s: size too large\n", path);
+		return -1;
+	}
+	const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	/* Allocate all the blocks up front, so that running out of space
+	 * is reported now rather than as a SIGBUS halfway through; not all
+	 * filesystems support this, in which case the file is just extended */
+	if (size && fallocate(fd, 0, 0, size) && errno != EOPNOTSUPP) {
+		/* Whatever was allocated (e.g. until ENOSPC) is given back,
+		 * rather than leaving the filesystem full */
+		fprintf(stderr, "cannot allocate %s: %s, leaving it empty\n",
+			path, strerror(errno));
+		if (ftruncate(fd, 0))
+			perror(path);
+		close(fd);
+		return -1;
+	}
+	if (ftruncate(fd, size)) {
+		fprintf(stderr, "cannot resize %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (!size) {
+		close(fd);
+		return 0;
+	}
+
+	uchar *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "cannot map %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	/* Only a hint, which most filesystems ignore for file mappings */
+	if (hugepages)
+		madvise(map, size, MADV_HUGEPAGE);
+
+	struct file_gen gen = {
+		.rng = rng,
+		.map = map,
+		.offset = offset,
+		.size = size,
+	};
+	pthread_t *threads = calloc(nthreads, sizeof(*threads));
+	if (threads == NULL)
 	{
-		increment *= 2;
+		fprintf(stderr, "out of memory");
+		abort();
+	}
+	for (int t = 0; t < nthreads; ++t) {
+		if (pthread_create(threads + t, NULL, file_worker, &gen)) {
+			fprintf(stderr, "failed to create worker thread\n");
+			abort();
+		}
+	}
+	for (int t = 0; t < nthreads; ++t)
+		pthread_join(threads[t], NULL);
+	free(threads);
+
+	/* The kernel writes the dirty pages back on its own; write errors
+	 * can only be caught by waiting for it here, though */
+	int ret = 0;
+	if (munmap(map, size) || fsync(fd)) {
+		fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+		ret = -1;
 	}
-	uchar *pnew = realloc(pool, pool_size + min_sz);
-	if (pnew == NULL)
+	if (close(fd) && !ret) {
+		fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+		ret = -1;
+	}
+	return ret;
+}
+
+/* Typed output: the stream can be output as raw bytes, or converted
+ * to (unsigned) 32- or 64-bit integers, doubles in [0, 1) or integers
+ * in a given range [lo, hi), either in binary (host byte order; range
+ * values are 64-bit) or as text, one value per line */
+enum out_type { OUT_BYTES, OUT_U32, OUT_U64, OUT_DOUBLE, OUT_RANGE };
+
+static const char * const out_type_names[] = {
+	"bytes", "u32", "u64", "double", "range"
+};
+
+struct typed_out {
+	enum out_type type;
+	bool text;
+	int64_t lo, hi; /* for OUT_RANGE */
+	unsigned long long count; /* number of values to produce */
+};
+
+/* Values are produced this many at a time */
+#define TYPED_BATCH 32768
+/* Longest text representation of a value, including the newline */
+#define TEXT_WIDTH 32
+
+/* Write the decimal representation of v followed by a newline at p,
+ * returning the end of the written text */
+static char *format_u64(char *p, uint64_t v)
+{
+	char digits[20];
+	int n = 0;
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n)
+		*p++ = digits[--n];
+	*p++ = '\n';
+	return p;
+}
+
+static char *format_i64(char *p, int64_t v)
+{
+	if (v < 0) {
+		*p++ = '-';
+		return format_u64(p, -(uint64_t)v);
+	}
+	return format_u64(p, v);
+}
+
+void generate_typed(struct sha256rng *rng, struct typed_out const *spec,
+	unsigned long long limit)
+{
+	static const size_t width[] = {
+		[OUT_BYTES] = sizeof(uchar),
+		[OUT_U32] = sizeof(uint32_t),
+		[OUT_U64] = sizeof(uint64_t),
+		[OUT_DOUBLE] = sizeof(double),
+		[OUT_RANGE] = sizeof(int64_t),
+	};
+	/* Each batch is written and read back through the pointer type of
+	 * the values it holds */
+	void *vals = malloc(TYPED_BATCH*sizeof(uint64_t));
+	char *text = malloc(TYPED_BATCH*TEXT_WIDTH);
+	if (vals == NULL || text == NULL)
 	{
 		fprintf(stderr, "out of memory");
 		abort();
 	}
-	pool = pnew;
-	pool_size += min_sz;
+
+	unsigned long long count = spec->count;
+	while (count && limit) {
+		const size_t n = count < TYPED_BATCH ? count : TYPED_BATCH;
+
+		switch (spec->type) {
+		case OUT_BYTES:
+			sha256rng_fill(rng, vals, n);
+			break;
+		case OUT_U32:
+			sha256rng_u32(rng, (uint32_t *)vals, n);
+			break;
+		case OUT_U64:
+			sha256rng_u64(rng, (uint64_t *)vals, n);
+			break;
+		case OUT_DOUBLE:
+			sha256rng_double(rng, (double *)vals, n);
+			break;
+		case OUT_RANGE:
+			sha256rng_range(rng, spec->lo, spec->hi, (int64_t *)vals, n);
+			break;
+		}
+
+		const char *out = (const char *)vals;
+		size_t len = n*width[spec->type];
+		if (spec->text) {
+			char *p = text;
+			for (size_t i = 0; i < n; ++i) {
+				switch (spec->type) {
+				case OUT_BYTES:
+					p = format_u64(p, ((uchar *)vals)[i]);
+					break;
+				case OUT_U32:
+					p = format_u64(p, ((uint32_t *)vals)[i]);
+					break;
+				case OUT_U64:
+					p = format_u64(p, ((uint64_t *)vals)[i]);
+					break;
+				case OUT_DOUBLE:
+					p += sprintf(p, "%.17g\n", ((double *)vals)[i]);
+					break;
+				case OUT_RANGE:
+					p = format_i64(p, ((int64_t *)vals)[i]);
+					break;
+				}
+			}
+			out = text;
+			len = p - text;
+		}
+
+		if (len > limit)
+			len = limit;
+		write_all(STDOUT_FILENO, (const uchar *)out, len);
+		if (limit != ULLONG_MAX)
+			limit -= len;
+		if (count != ULLONG_MAX)
+			count -= n;
+	}
+	free(text);
+	free(vals);
 }
 
-/* Shift the pool backwards to start from the pool_cursor */
-void shift_pool()
+/* Parse a range specification lo:hi */
+static void parse_range(const char *arg, struct typed_out *spec)
 {
-#ifdef DEBUG
-	fprintf(stderr, "pre-shift: %zu %zu %zu | %u | %u\n",
-		pool_cursor, pool_use, pool_size,
-		pool[pool_cursor], pool[pool_use - 1]);
-#endif
-	/* Assumes pool_cursor >= pool_size/2 */
-	memcpy(pool, pool + pool_cursor, pool_size - pool_cursor);
-	pool_use -= pool_cursor;
-	pool_cursor = 0;
-#ifdef DEBUG
-	fprintf(stderr, "post-shift: %zu %zu %zu | %u | %u\n",
-		pool_cursor, pool_use, pool_size,
-		pool[pool_cursor], pool[pool_use - 1]);
-#endif
+	char *end;
+	errno = 0;
+	spec->lo = strtoll(arg, &end, 0);
+	if (!errno && *end == ':') {
+		const char *hi = end + 1;
+		spec->hi = strtoll(hi, &end, 0);
+		if (!errno && end != hi && !*end && spec->lo < spec->hi)
+			return;
+	}
+	fprintf(stderr, "invalid range '%s'\n", arg);
+	exit(1);
 }
 
-/* Add the pool hash to the pool itself */
-void repool()
+/*
+ * Benchmark: report the throughput of each generator mode and output path
+ */
+
+static double now(void)
 {
-#ifdef DEBUG
-	fputs("repooling\n", stderr);
-#endif
-	prepare_pool();
-	SHA256(pool, pool_use, pool + pool_use);
-	pool_use += min_sz;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
 }
 
-void pool_str(const char *arg)
+/* Each benchmark runs for (at least) this long */
+#define BENCH_TIME 0.5
+
+struct bench_ctx {
+	struct sha256rng *rng; /* counter mode generator */
+	struct sha256rng *legacy; /* legacy generator */
+	uint64_t offset; /* for fill_at */
+	int jobs;
+	int null_fd;
+	int pipe_fd; /* write end of a pipe, which a thread drains */
+	char *path; /* scratch file for the --output path */
+	char *text;
+};
+
+struct bench_thread {
+	struct sha256rng const *rng;
+	uint64_t offset;
+	uchar *buf;
+};
+
+static void *bench_fill_at(void *arg)
 {
-#ifdef DEBUG
-	fprintf(stderr, "pooling '%s'", arg);
-#endif
-	prepare_pool();
-	SHA256((const uchar *)arg, strlen(arg), pool + pool_use);
-	pool_use += min_sz;
+	struct bench_thread *t = arg;
+	sha256rng_fill_at(t->rng, t->offset, t->buf, OUTBUF_SIZE);
+	return NULL;
 }
 
-/* produce a random byte from the pool, optionally enlarging the pool
- * if necessary */
-void consume()
+/* Each benchmark produces OUTBUF_SIZE bytes worth of output in buf,
+ * and returns the number of bytes produced */
+static size_t bench_counter(struct bench_ctx *ctx, uchar *buf)
 {
-	if (pool_use - pool_cursor < min_sz)
-		repool();
-	fwrite(pool + (pool_cursor++), sizeof(uchar), 1, stdout);
-	if (pool_cursor > pool_size/2)
-		shift_pool();
+	sha256rng_fill(ctx->rng, buf, OUTBUF_SIZE);
+	return OUTBUF_SIZE;
 }
 
+static size_t bench_legacy(struct bench_ctx *ctx, uchar *buf)
+{
+	sha256rng_fill(ctx->legacy, buf, OUTBUF_SIZE);
+	return OUTBUF_SIZE;
+}
 
-int main(int argc, char *argv[])
+static size_t bench_parallel(struct bench_ctx *ctx, uchar *buf)
+{
+	pthread_t threads[ctx->jobs];
+	struct bench_thread args[ctx->jobs];
+	for (int t = 0; t < ctx->jobs; ++t) {
+		args[t].rng = ctx->rng;
+		args[t].offset = ctx->offset;
+		args[t].buf = buf + t*OUTBUF_SIZE;
+		ctx->offset += OUTBUF_SIZE;
+		if (pthread_create(threads + t, NULL, bench_fill_at, args + t)) {
+			fprintf(stderr, "failed to create benchmark thread\n");
+			abort();
+		}
+	}
+	for (int t = 0; t < ctx->jobs; ++t)
+		pthread_join(threads[t], NULL);
+	return (size_t)ctx->jobs*OUTBUF_SIZE;
+}
+
+static size_t bench_u32(struct bench_ctx *ctx, uchar *buf)
+{
+	sha256rng_u32(ctx->rng, (uint32_t *)buf, OUTBUF_SIZE/sizeof(uint32_t));
+	return OUTBUF_SIZE;
+}
+
+static size_t bench_u64(struct bench_ctx *ctx, uchar *buf)
+{
+	sha256rng_u64(ctx->rng, (uint64_t *)buf, OUTBUF_SIZE/sizeof(uint64_t));
+	return OUTBUF_SIZE;
+}
+
+static size_t bench_double(struct bench_ctx *ctx, uchar *buf)
+{
+	sha256rng_double(ctx->rng, (double *)buf, OUTBUF_SIZE/sizeof(double));
+	return OUTBUF_SIZE;
+}
+
+/* Counted in bytes of the stream consumed rather than of the (64-bit)
+ * output, so as to compare with the other rows: the candidates are 32-bit,
+ * and for this span practically none (296 in 2^32) are rejected */
+static size_t bench_range(struct bench_ctx *ctx, uchar *buf)
+{
+	const size_t n = OUTBUF_SIZE/sizeof(int64_t);
+	sha256rng_range(ctx->rng, 0, 1000, (int64_t *)buf, n);
+	return n*sizeof(uint32_t);
+}
+
+static size_t bench_text(struct bench_ctx *ctx, uchar *buf)
+{
+	const size_t n = OUTBUF_SIZE/TEXT_WIDTH;
+	uint32_t *vals = (uint32_t *)buf;
+	sha256rng_u32(ctx->rng, vals, n);
+	char *p = ctx->text;
+	for (size_t i = 0; i < n; ++i)
+		p = format_u64(p, vals[i]);
+	return p - ctx->text;
+}
+
+static size_t bench_write(struct bench_ctx *ctx, uchar *buf)
+{
+	sha256rng_fill(ctx->rng, buf, OUTBUF_SIZE);
+	write_all(ctx->null_fd, buf, OUTBUF_SIZE);
+	return OUTBUF_SIZE;
+}
+
+static size_t bench_pipelined(struct bench_ctx *ctx, uchar *buf)
+{
+	(void)buf;
+	generate_pipelined(ctx->rng, ctx->null_fd, 16*OUTBUF_SIZE, false);
+	return 16*OUTBUF_SIZE;
+}
+
+static size_t bench_pipe(struct bench_ctx *ctx, uchar *buf)
+{
+	(void)buf;
+	generate_pipelined(ctx->rng, ctx->pipe_fd, 16*OUTBUF_SIZE, false);
+	return 16*OUTBUF_SIZE;
+}
+
+static size_t bench_zero_copy(struct bench_ctx *ctx, uchar *buf)
+{
+	(void)buf;
+	generate_pipelined(ctx->rng, ctx->pipe_fd, 16*OUTBUF_SIZE, true);
+	return 16*OUTBUF_SIZE;
+}
+
+/* Including the final fsync(), as for --output */
+static size_t bench_file(struct bench_ctx *ctx, uchar *buf)
+{
+	(void)buf;
+	if (generate_to_file(ctx->rng, ctx->path, ctx->offset, FILE_CHUNK_SIZE,
+		ctx->jobs, false))
+		exit(1);
+	ctx->offset += FILE_CHUNK_SIZE;
+	return FILE_CHUNK_SIZE;
+}
+
+/* Reads (rather than splices) whatever comes out of the pipe, as a
+ * --zero-copy reader must */
+static void *bench_drain(void *arg)
+{
+	const int fd = *(int *)arg;
+	uchar *buf = malloc(OUTBUF_SIZE);
+	if (buf == NULL)
+	{
+		fprintf(stderr, "out of memory");
+		abort();
+	}
+	while (read(fd, buf, OUTBUF_SIZE) > 0)
+		;
+	free(buf);
+	return NULL;
+}
+
+static const struct {
+	size_t (*func)(struct bench_ctx *ctx, uchar *buf);
+	const char *name;
+} benchmarks[] = {
+	{ bench_counter, "counter mode" },
+	{ bench_legacy, "legacy mode" },
+	{ bench_parallel, "counter mode, parallel" },
+	{ bench_u32, "u32" },
+	{ bench_u64, "u64" },
+	{ bench_double, "double" },
+	{ bench_range, "range [0, 1000)" },
+	{ bench_text, "u32 as text" },
+	{ bench_write, "write to /dev/null" },
+	{ bench_pipelined, "pipelined to /dev/null" },
+	{ bench_pipe, "pipelined to a pipe" },
+	{ bench_zero_copy, "zero-copy to a pipe" },
+	{ bench_file, "--output to a file" },
+};
+
+void run_benchmarks(struct sha256rng *rng, int jobs)
+{
+	struct sha256rng legacy;
+	sha256rng_init(&legacy, SHA256RNG_LEGACY);
+
+	struct bench_ctx ctx = {
+		.rng = rng,
+		.legacy = &legacy,
+		.jobs = jobs,
+		.null_fd = open("/dev/null", O_WRONLY),
+		.text = malloc(OUTBUF_SIZE),
+	};
+	uchar *buf = malloc((size_t)jobs*OUTBUF_SIZE);
+	const char *tmpdir = getenv("TMPDIR");
+	int pipe_fds[2];
+	pthread_t drain;
+	if (buf == NULL || ctx.text == NULL || ctx.null_fd < 0 ||
+		asprintf(&ctx.path, "%s/sha256rng-bench-XXXXXX",
+			tmpdir ? tmpdir : "/tmp") < 0 ||
+		close(mkstemp(ctx.path)) ||
+		pipe(pipe_fds) ||
+		pthread_create(&drain, NULL, bench_drain, pipe_fds + 0))
+	{
+		fprintf(stderr, "failed to set up the benchmarks");
+		abort();
+	}
+	ctx.pipe_fd = pipe_fds[1];
+
+	for (size_t b = 0; b < sizeof(benchmarks)/sizeof(*benchmarks); ++b) {
+		unsigned long long bytes = 0;
+		const double start = now();
+		double elapsed;
+		do {
+			bytes += benchmarks[b].func(&ctx, buf);
+			elapsed = now() - start;
+		} while (elapsed < BENCH_TIME);
+		printf("%-24s", benchmarks[b].name);
+		if (benchmarks[b].func == bench_parallel ||
+			benchmarks[b].func == bench_file)
+			printf(" (%d threads)", jobs);
+		else
+			printf("            ");
+		printf(" %10.1f MB/s\n", bytes/elapsed*1e-6);
+		fflush(stdout);
+	}
+
+	close(ctx.pipe_fd);
+	pthread_join(drain, NULL);
+	close(pipe_fds[0]);
+	unlink(ctx.path);
+	free(ctx.path);
+	close(ctx.null_fd);
+	free(ctx.text);
+	free(buf);
+	sha256rng_free(&legacy);
+}
+
+/*
+ * Self test: quick statistical checks of the stream quality
+ */
+
+/* Default amount of data tested */
+#define SELFTEST_SIZE (64ULL << 20)
+
+/* Significance level: a test fails if its p-value is below this (or,
+ * for the chi-square test, if it's suspiciously close to 1) */
+#define SELFTEST_ALPHA 0.001
+
+/* Statistics collected over a range of the stream. Bits are taken from
+ * the most significant of each byte */
+struct selftest_stats {
+	uint64_t bytes;
+	uint64_t hist[UCHAR_MAX + 1];
+	uint64_t transitions; /* bit changes, for the runs test */
+	uint64_t sumprod; /* sum of the products of consecutive bytes */
+	uchar first, last;
+};
+
+static void selftest_collect(struct selftest_stats *st, const uchar *buf, size_t n)
+{
+	if (!n)
+		return;
+	uchar prev = st->bytes ? st->last : buf[0];
+	if (!st->bytes)
+		st->first = buf[0];
+	for (size_t i = 0; i < n; ++i) {
+		const uchar cur = buf[i];
+		++st->hist[cur];
+		/* changes within the byte, and from the last bit of the previous one */
+		st->transitions += __builtin_popcount((cur ^ (cur >> 1)) & 0x7f);
+		if (i || st->bytes)
+			st->transitions += (prev & 1) ^ (cur >> 7);
+		if (i || st->bytes)
+			st->sumprod += (uint64_t)prev*cur;
+		prev = cur;
+	}
+	st->last = prev;
+	st->bytes += n;
+}
+
+/* Merge the statistics of the range following dst into dst */
+static void selftest_merge(struct selftest_stats *dst, struct selftest_stats const *src)
+{
+	if (!src->bytes)
+		return;
+	if (dst->bytes) {
+		dst->transitions += (dst->last & 1) ^ (src->first >> 7);
+		dst->sumprod += (uint64_t)dst->last*src->first;
+	} else {
+		dst->first = src->first;
+	}
+	for (int i = 0; i <= UCHAR_MAX; ++i)
+		dst->hist[i] += src->hist[i];
+	dst->transitions += src->transitions;
+	dst->sumprod += src->sumprod;
+	dst->last = src->last;
+	dst->bytes += src->bytes;
+}
+
+struct selftest_thread {
+	struct sha256rng const *rng;
+	uint64_t offset;
+	uint64_t len;
+	struct selftest_stats stats;
+};
+
+static void *selftest_worker(void *arg)
 {
-	if (argc == 1)
-		repool();
-	else while (--argc)
+	struct selftest_thread *t = arg;
+	uchar *buf = malloc(OUTBUF_SIZE);
+	if (buf == NULL)
 	{
-		pool_str(*(++argv));
+		fprintf(stderr, "out of memory");
+		abort();
+	}
+	for (uint64_t done = 0; done < t->len; ) {
+		const size_t chunk = t->len - done < OUTBUF_SIZE ? t->len - done : OUTBUF_SIZE;
+		sha256rng_fill_at(t->rng, t->offset + done, buf, chunk);
+		selftest_collect(&t->stats, buf, chunk);
+		done += chunk;
+	}
+	free(buf);
+	return NULL;
+}
+
+static bool selftest_report(const char *name, double stat, double p, bool pass)
+{
+	printf("%-24s %14.4f   p = %.6f   %s\n", name, stat, p,
+		pass ? "PASS" : "FAIL");
+	return pass;
+}
+
+/* Run the self tests on the next `size` bytes of the stream, splitting
+ * the work among the given number of threads. Returns true if all tests
+ * pass */
+bool run_selftest(struct sha256rng *rng, uint64_t offset, uint64_t size, int jobs)
+{
+	struct selftest_stats st;
+	memset(&st, 0, sizeof(st));
+
+	if (rng->mode == SHA256RNG_LEGACY) {
+		/* The legacy stream can only be read sequentially */
+		uchar *buf = malloc(OUTBUF_SIZE);
+		if (buf == NULL)
+		{
+			fprintf(stderr, "out of memory");
+			abort();
+		}
+		for (uint64_t done = 0; done < size; ) {
+			const size_t chunk = size - done < OUTBUF_SIZE ? size - done : OUTBUF_SIZE;
+			sha256rng_fill(rng, buf, chunk);
+			selftest_collect(&st, buf, chunk);
+			done += chunk;
+		}
+		free(buf);
+	} else {
+		struct selftest_thread *threads = calloc(jobs, sizeof(*threads));
+		pthread_t *tid = calloc(jobs, sizeof(*tid));
+		if (threads == NULL || tid == NULL)
+		{
+			fprintf(stderr, "out of memory");
+			abort();
+		}
+		const uint64_t per_thread = size/jobs;
+		for (int t = 0; t < jobs; ++t) {
+			threads[t].rng = rng;
+			threads[t].offset = offset + t*per_thread;
+			threads[t].len = t == jobs - 1 ? size - t*per_thread : per_thread;
+			if (pthread_create(tid + t, NULL, selftest_worker, threads + t)) {
+				fprintf(stderr, "failed to create worker thread\n");
+				abort();
+			}
+		}
+		for (int t = 0; t < jobs; ++t) {
+			pthread_join(tid[t], NULL);
+			selftest_merge(&st, &threads[t].stats);
+		}
+		free(tid);
+		free(threads);
+	}
+
+	if (st.bytes < 2) {
+		fprintf(stderr, "not enough data to test\n");
+		return false;
+	}
+
+	const double n = st.bytes;
+	const double nbits = 8*n;
+	uint64_t ones = 0, sum = 0, sumsq = 0;
+	for (int i = 0; i <= UCHAR_MAX; ++i) {
+		ones += st.hist[i]*__builtin_popcount(i);
+		sum += st.hist[i]*i;
+		sumsq += st.hist[i]*i*i;
+	}
+
+	printf("Testing %llu bytes with %d thread(s)\n",
+		(unsigned long long)st.bytes, rng->mode == SHA256RNG_LEGACY ? 1 : jobs);
+	bool pass = true;
+
+	/* Monobit: the proportion of ones should be close to 1/2 */
+	const double s_obs = fabs(2.0*ones - nbits)/sqrt(nbits);
+	double p = erfc(s_obs/M_SQRT2);
+	pass &= selftest_report("monobit", s_obs, p, p >= SELFTEST_ALPHA);
+
+	/* Runs: the number of runs of identical bits should be close to
+	 * what is expected given the proportion of ones */
+	const double pi = ones/nbits;
+	const double runs = st.transitions + 1;
+	p = 0;
+	if (fabs(pi - 0.5) < 2/sqrt(nbits))
+		p = erfc(fabs(runs - 2*nbits*pi*(1 - pi))/
+			(2*sqrt(2*nbits)*pi*(1 - pi)));
+	pass &= selftest_report("runs", runs, p, p >= SELFTEST_ALPHA);
+
+	/* Chi-square of the byte frequencies, 255 degrees of freedom; the
+	 * p-value uses the Wilson-Hilferty approximation */
+	const double expected = n/(UCHAR_MAX + 1);
+	double chi2 = 0;
+	for (int i = 0; i <= UCHAR_MAX; ++i)
+		chi2 += (st.hist[i] - expected)*(st.hist[i] - expected)/expected;
+	const double k = UCHAR_MAX;
+	const double wh = (cbrt(chi2/k) - (1 - 2/(9*k)))/sqrt(2/(9*k));
+	p = 0.5*erfc(wh/M_SQRT2);
+	pass &= selftest_report("chi-square (bytes)", chi2, p,
+		p >= SELFTEST_ALPHA && p <= 1 - SELFTEST_ALPHA);
+
+	/* Serial correlation of consecutive bytes, which for a random
+	 * stream is normally distributed with variance 1/n */
+	const double m = n - 1;
+	const double sx = sum - st.last, sy = sum - st.first;
+	const double sxx = sumsq - (double)st.last*st.last;
+	const double syy = sumsq - (double)st.first*st.first;
+	const double r = (m*st.sumprod - sx*sy)/
+		sqrt((m*sxx - sx*sx)*(m*syy - sy*sy));
+	p = erfc(fabs(r)*sqrt(m)/M_SQRT2);
+	pass &= selftest_report("serial correlation", r, p, p >= SELFTEST_ALPHA);
+
+	return pass;
+}
+
+static void usage(FILE *out, const char *prog)
+{
+	fprintf(out,
+		"Usage: %s [options] [--] [seed...]\n"
+		"Produce random bytes on stdout from the SHA256 of the given seeds.\n"
+		"\n"
+		"  -f, --seed-file=F also use the contents of file F as a seed\n"
+		"                    (after the command-line seeds, in order)\n"
+		"      --seed-stdin  also use the standard input as a seed\n"
+		"  -l, --legacy      produce the stream of the original pool-hashing\n"
+		"                    generator, rather than the (faster) counter mode one\n"
+		"  -o, --offset=N    start from byte N of the stream (counter mode only)\n"
+		"  -n, --length=N    produce at most N bytes\n"
+		"  -s, --stream=K    produce sub-stream K of the seeds (counter mode\n"
+		"                    only): different sub-streams never overlap\n"
+		"  -j, --jobs=N      generate with N threads (counter mode only)\n"
+		"  -O, --output=FILE write --size bytes to FILE rather than to stdout,\n"
+		"                    generating them in place with --jobs threads\n"
+		"                    (counter mode only, all the cores by default)\n"
+		"      --size=N      size of the --output file (--length by default)\n"
+		"      --hugepages   ask for huge pages for the --output mapping\n"
+		"  -Z, --zero-copy   if the output is a pipe, move the generated pages\n"
+		"                    into it with vmsplice() rather than copying them;\n"
+		"                    the reader must read() them from the pipe\n"
+		"                    (raw bytes from a single job only)\n"
+		"  -t, --type=TYPE   output values of the given type: bytes (default),\n"
+		"                    u32, u64, double (in [0, 1)), range (see below)\n"
+		"  -r, --range=A:B   output integers in [A, B), without modulo bias\n"
+		"  -T, --text        output values as text, one per line, rather\n"
+		"                    than in binary (host byte order)\n"
+		"  -c, --count=N     produce at most N values\n"
+		"      --bench       report the throughput of each generator mode\n"
+		"                    and output path\n"
+		"      --selftest    run some quick statistical tests on the stream\n"
+		"                    (on --length bytes, 64M by default), with\n"
+		"                    --jobs threads (all the cores by default)\n"
+		"  -h, --help        show this help\n"
+		"\n"
+		"Sizes can be followed by one of the (binary) suffixes K, M, G, T.\n"
+		"The SHA256RNG_LIMIT environment variable also limits the number of\n"
+		"bytes produced.\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "legacy", no_argument, NULL, 'l' },
+		{ "offset", required_argument, NULL, 'o' },
+		{ "length", required_argument, NULL, 'n' },
+		{ "stream", required_argument, NULL, 's' },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "zero-copy", no_argument, NULL, 'Z' },
+		{ "output", required_argument, NULL, 'O' },
+		{ "size", required_argument, NULL, 'z' },
+		{ "hugepages", no_argument, NULL, 'H' },
+		{ "type", required_argument, NULL, 't' },
+		{ "range", required_argument, NULL, 'r' },
+		{ "text", no_argument, NULL, 'T' },
+		{ "count", required_argument, NULL, 'c' },
+		{ "seed-file", required_argument, NULL, 'f' },
+		{ "seed-stdin", no_argument, NULL, 'I' },
+		{ "bench", no_argument, NULL, 'B' },
+		{ "selftest", no_argument, NULL, 'S' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	bool legacy = false;
+	unsigned long long offset = 0;
+	unsigned long long length = ULLONG_MAX;
+	bool substream = false;
+	unsigned long long stream_id = 0;
+	int jobs = 1;
+	struct typed_out typed = { .type = OUT_BYTES, .count = ULLONG_MAX };
+	bool have_range = false;
+	bool bench = false, selftest = false;
+	bool have_jobs = false;
+	bool zero_copy = false;
+	const char *output = NULL;
+	unsigned long long size = ULLONG_MAX;
+	bool hugepages = false;
+	/* Seed files, NULL for stdin */
+	const char **seed_files = calloc(argc, sizeof(*seed_files));
+	int num_seed_files = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "lo:n:s:j:ZO:t:r:Tc:f:h", options, NULL)) != -1) {
+		switch (opt) {
+		case 'l':
+			legacy = true;
+			break;
+		case 'o':
+			offset = parse_size(optarg, "offset");
+			break;
+		case 'n':
+			length = parse_size(optarg, "length");
+			break;
+		case 's':
+			stream_id = parse_size(optarg, "stream");
+			substream = true;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				fprintf(stderr, "invalid number of jobs '%s'\n", optarg);
+				return 1;
+			}
+			have_jobs = true;
+			break;
+		case 't':
+			for (typed.type = 0; typed.type < OUT_RANGE; ++typed.type)
+				if (!strcmp(optarg, out_type_names[typed.type]))
+					break;
+			if (strcmp(optarg, out_type_names[typed.type])) {
+				fprintf(stderr, "invalid type '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			parse_range(optarg, &typed);
+			typed.type = OUT_RANGE;
+			have_range = true;
+			break;
+		case 'T':
+			typed.text = true;
+			break;
+		case 'c':
+			typed.count = parse_size(optarg, "count");
+			break;
+		case 'f':
+			seed_files[num_seed_files++] = optarg;
+			break;
+		case 'I':
+			seed_files[num_seed_files++] = NULL;
+			break;
+		case 'Z':
+			zero_copy = true;
+			break;
+		case 'O':
+			output = optarg;
+			break;
+		case 'z':
+			size = parse_size(optarg, "size");
+			break;
+		case 'H':
+			hugepages = true;
+			break;
+		case 'B':
+			bench = true;
+			break;
+		case 'S':
+			selftest = true;
+			break;
+		case 'h':
+			usage(stdout, argv[0]);
+			return 0;
+		default:
+			usage(stderr, argv[0]);
+			return 1;
+		}
+	}
+
+	if (legacy && offset) {
+		fprintf(stderr, "the legacy stream cannot be seeked\n");
+		return 1;
+	}
+	if (legacy && substream) {
+		fprintf(stderr, "the legacy stream has no sub-streams\n");
+		return 1;
+	}
+	if (legacy && output) {
+		fprintf(stderr, "the legacy stream cannot be written with --output\n");
+		return 1;
+	}
+	if ((bench || selftest || output) && !have_jobs) {
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs < 1)
+			jobs = 1;
+	}
+	if (legacy && jobs > 1 && !bench && !selftest) {
+		fprintf(stderr, "the legacy stream cannot be generated in parallel\n");
+		return 1;
+	}
+	if (typed.type == OUT_RANGE && !have_range) {
+		fprintf(stderr, "the range type needs a --range\n");
+		return 1;
+	}
+	const bool raw = typed.type == OUT_BYTES && !typed.text &&
+		typed.count == ULLONG_MAX;
+	if (!raw && jobs > 1 && !bench && !selftest && !output) {
+		fprintf(stderr, "only raw bytes can be generated in parallel\n");
+		return 1;
+	}
+	if (!raw && output) {
+		fprintf(stderr, "only raw bytes can be written with --output\n");
+		return 1;
+	}
+	if (zero_copy && output) {
+		fprintf(stderr, "--zero-copy only applies to standard output, not --output\n");
+		return 1;
+	}
+	if (zero_copy && !raw && !bench && !selftest) {
+		fprintf(stderr, "only raw bytes can be written with --zero-copy\n");
+		return 1;
+	}
+	if (zero_copy && jobs > 1 && !bench && !selftest) {
+		fprintf(stderr, "--zero-copy cannot be combined with --jobs\n");
+		return 1;
+	}
+	if (output && size == ULLONG_MAX)
+		size = length;
+	if (output && size == ULLONG_MAX) {
+		fprintf(stderr, "--output needs a --size\n");
+		return 1;
 	}
 
-	long long limit = SIZE_MAX;
+	struct sha256rng rng;
+	sha256rng_init(&rng, legacy ? SHA256RNG_LEGACY : SHA256RNG_COUNTER);
+
+	for (int i = optind; i < argc; ++i)
+		sha256rng_seed(&rng, argv[i], strlen(argv[i]));
+
+	for (int i = 0; i < num_seed_files; ++i) {
+		const char *name = seed_files[i] ? seed_files[i] : "standard input";
+		const int fd = seed_files[i] ?
+			open(seed_files[i], O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+		if (fd < 0 || sha256rng_seed_fd(&rng, fd)) {
+			fprintf(stderr, "cannot seed from %s: %s\n", name, strerror(errno));
+			return 1;
+		}
+		if (fd != STDIN_FILENO)
+			close(fd);
+	}
+	free(seed_files);
+
+	if (substream)
+		sha256rng_stream(&rng, stream_id);
+
+	if (offset)
+		sha256rng_seek(&rng, offset);
+
+	if (bench) {
+		run_benchmarks(&rng, jobs);
+		sha256rng_free(&rng);
+		return 0;
+	}
+	if (selftest) {
+		const bool pass = run_selftest(&rng, offset,
+			length == ULLONG_MAX ? SELFTEST_SIZE : length, jobs);
+		sha256rng_free(&rng);
+		return pass ? 0 : 1;
+	}
+
+	unsigned long long limit = ULLONG_MAX;
 	const char *limit_env = getenv("SHA256RNG_LIMIT");
 	if (limit_env && *limit_env) {
 		limit = atoll(limit_env);
@@ -114,7 +1363,28 @@ int main(int argc, char *argv[])
 			limit);
 		fflush(stderr);
 	}
+	if (length < limit)
+		limit = length;
+
+	if (output) {
+		const int ret = generate_to_file(&rng, output, offset,
+			size < limit ? size : limit, jobs, hugepages);
+		sha256rng_free(&rng);
+		return ret ? 1 : 0;
+	}
+
+	if (jobs > 1) {
+		generate_parallel(&rng, offset, limit, jobs);
+		sha256rng_free(&rng);
+		return 0;
+	}
+
+	if (!raw) {
+		generate_typed(&rng, &typed, limit);
+		sha256rng_free(&rng);
+		return 0;
+	}
 
-	while (limit--)
-		consume();
+	generate_pipelined(&rng, STDOUT_FILENO, limit, zero_copy);
+	sha256rng_free(&rng);
 }
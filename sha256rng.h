@@ -0,0 +1,117 @@
+/* SHA256-based pseudo-random number generator, as a library.
+ *
+ * All the generator state lives in a struct sha256rng, so any number of
+ * generators can be used at the same time, e.g. one per thread.
+ *
+ * Usage: sha256rng_init() the generator, feed it the seeds with
+ * sha256rng_seed() (not seeding at all is fine too), then read the stream
+ * with sha256rng_fill(); release the generator with sha256rng_free().
+ * All seeds must be given before reading from the stream.
+ */
+
+#ifndef SHA256RNG_H
+#define SHA256RNG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <openssl/sha.h>
+
+enum sha256rng_mode {
+	/* Block i of the stream is SHA256(key || le64(i)), where the key is
+	 * the SHA256 of the seed pool (the concatenated digests of the
+	 * seeds). Every block costs a single short hash, and the stream can
+	 * be accessed at any offset */
+	SHA256RNG_COUNTER,
+	/* The original generator: new bytes are produced by hashing the
+	 * pool so far. Kept to reproduce old streams */
+	SHA256RNG_LEGACY,
+};
+
+struct sha256rng {
+	enum sha256rng_mode mode;
+
+	/* Seed pool, and in legacy mode the whole generator state:
+	 * a ring buffer of pool_cap bytes, holding the stream between
+	 * the (absolute) positions pool_base and pool_use */
+	unsigned char *pool;
+	size_t pool_cap;
+	size_t pool_size; /* size of the original linear pool */
+	uint64_t pool_base;
+	uint64_t pool_use;
+	uint64_t pool_cursor;
+
+	/* Counter mode state */
+	SHA256_CTX base; /* hash state after the key */
+	bool substream; /* are we producing a sub-stream? */
+	uint64_t stream_id; /* which one */
+	uint64_t block; /* index of the next block to compute */
+	size_t cursor; /* next byte to return from out */
+	unsigned char out[SHA256_DIGEST_LENGTH];
+};
+
+void sha256rng_init(struct sha256rng *rng, enum sha256rng_mode mode);
+
+/* Add the digest of the given data to the seed pool */
+void sha256rng_seed(struct sha256rng *rng, const void *data, size_t len);
+
+/* Add an already computed digest to the seed pool */
+void sha256rng_seed_digest(struct sha256rng *rng,
+	const unsigned char digest[SHA256_DIGEST_LENGTH]);
+
+/* Add the digest of everything that can be read from fd to the seed pool.
+ * The data is hashed as it is read (or mapped, for regular files), so
+ * seeds of any size take constant memory. Returns 0 on success, -1 on
+ * failure (with errno set), in which case the pool is unchanged */
+int sha256rng_seed_fd(struct sha256rng *rng, int fd);
+
+/* Counter mode can also produce independent sub-streams of the same
+ * seed: block i of sub-stream k is SHA256(key || le64(i) || le64(k)).
+ * Since the hashed messages of different (sub-)streams are all different,
+ * no two streams can overlap.
+ *
+ * Switch to sub-stream k of the seed, starting from its beginning. This
+ * is O(1); returns -1 for the legacy stream, which has no sub-streams */
+int sha256rng_stream(struct sha256rng *rng, uint64_t k);
+
+/* Initialize dst as a generator for sub-stream k of the (counter mode)
+ * generator src, which is left untouched. Returns -1 if src is a legacy
+ * generator */
+int sha256rng_split(struct sha256rng *dst, struct sha256rng const *src,
+	uint64_t k);
+
+/* Move to the given byte offset of the stream. This is O(1) in counter
+ * mode; returns -1 for the legacy stream, which cannot be seeked */
+int sha256rng_seek(struct sha256rng *rng, uint64_t offset);
+
+/* Fill buf with the next n bytes of the stream */
+void sha256rng_fill(struct sha256rng *rng, void *buf, size_t n);
+
+/* Fill buf with the n bytes of the counter mode stream starting at the
+ * given offset, without changing the position of the generator. The
+ * generator is not modified, so this can be called concurrently from
+ * multiple threads */
+void sha256rng_fill_at(struct sha256rng const *rng, uint64_t offset,
+	void *buf, size_t n);
+
+/* Typed output. Integers are read from the stream in little-endian
+ * order, whole arrays at a time, so these run at close to the speed
+ * of sha256rng_fill() */
+
+void sha256rng_u32(struct sha256rng *rng, uint32_t *out, size_t n);
+void sha256rng_u64(struct sha256rng *rng, uint64_t *out, size_t n);
+
+/* Doubles uniformly distributed in [0, 1), from the top 53 bits
+ * of 64-bit integers */
+void sha256rng_double(struct sha256rng *rng, double *out, size_t n);
+
+/* Integers uniformly distributed in [lo, hi), without modulo bias
+ * (using Lemire's multiply-shift with rejection). Rejected candidates are
+ * skipped, so the number of bytes consumed varies; requires lo < hi */
+void sha256rng_range(struct sha256rng *rng, int64_t lo, int64_t hi,
+	int64_t *out, size_t n);
+
+void sha256rng_free(struct sha256rng *rng);
+
+#endif
@@ -6,17 +6,31 @@
  *
  * Each circle is deterministically generated using the SHA-256 hash of the ‘spell string’,
  * producing SVG output.
+ *
+ * Usage: svg-magic-circle [spell] for a single circle on stdout, or
+ * svg-magic-circle --batch [options] for many circles (see batch_usage()).
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <math.h>
 
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+
 #include <openssl/sha.h>
 
+#include "digest-cache.h"
+#include "display-list.h"
+#include "raster.h"
+
 #ifndef M_PI
 #define M_PI 3.1415926535897932384626433832795
 #endif
@@ -36,6 +50,96 @@ typedef unsigned int uint;
 	abort(); \
 } while(0)
 
+/* SVG output: documents are built in a growable buffer, and written out
+ * in one go once complete. Numbers are formatted by hand, and literal
+ * fragments are appended with their size known at compile time, since
+ * going through printf for each attribute dominates the cost of a
+ * circle otherwise */
+struct svg_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+	/* Shapes defined so far in the document, see svg_begin_shape() */
+	int nshapes;
+	struct dl_shape shapes[32];
+};
+
+/* Make room for at least n more bytes */
+static void svg_reserve(struct svg_buf *out, size_t n)
+{
+	if (out->cap - out->len >= n)
+		return;
+	size_t cap = out->cap ? out->cap : 4096;
+	while (cap - out->len < n)
+		cap *= 2;
+	char *data = realloc(out->data, cap);
+	if (data == NULL)
+	{
+		fprintf(stderr, "out of memory");
+		abort();
+	}
+	out->data = data;
+	out->cap = cap;
+}
+
+static inline void svg_append(struct svg_buf *out, const char *s, size_t n)
+{
+	svg_reserve(out, n);
+	memcpy(out->data + out->len, s, n);
+	out->len += n;
+}
+
+/* Append a string literal */
+#define svg_lit(out, s) svg_append(out, "" s, sizeof(s) - 1)
+
+static inline void svg_str(struct svg_buf *out, const char *s)
+{
+	svg_append(out, s, strlen(s));
+}
+
+/* Append a decimal integer */
+static void svg_int(struct svg_buf *out, int v)
+{
+	char digits[16];
+	char *p = digits + sizeof(digits);
+	/* Work on the magnitude as unsigned, so INT_MIN is fine too */
+	uint u = v < 0 ? -(uint)v : (uint)v;
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (v < 0)
+		*--p = '-';
+	svg_append(out, p, digits + sizeof(digits) - p);
+}
+
+/* Append a hexadecimal integer, like %#x */
+static void svg_hex(struct svg_buf *out, uint v)
+{
+	static const char xdigits[] = "0123456789abcdef";
+	char digits[2 + 2*sizeof(v)];
+	char *p = digits + sizeof(digits);
+	if (!v) {
+		svg_lit(out, "0");
+		return;
+	}
+	do {
+		*--p = xdigits[v & 0xf];
+		v >>= 4;
+	} while (v);
+	*--p = 'x';
+	*--p = '0';
+	svg_append(out, p, digits + sizeof(digits) - p);
+}
+
+/* Append the coordinates of a point, as "x y" */
+static inline void svg_point(struct svg_buf *out, int x, int y)
+{
+	svg_int(out, x);
+	svg_lit(out, " ");
+	svg_int(out, y);
+}
+
 #define SIDES_MASK 0x7 /* 0b111 */
 #define MAX_NVERT 8 /* maximum number of vertices */
 
@@ -51,11 +155,85 @@ struct control {
 	int bearing; /* 0 to MAX_BEARING = 0 */
 };
 
+/* Sines and cosines of the bearings, computed once by init_trig_table()
+ * with the very same expression new_pos() used to evaluate, so that the
+ * coordinates are exactly the same. Bearings go somewhat out of the
+ * 0..MAX_BEARING range when features are rotated, hence the margin
+ * (there is no range reduction, since it would change the results);
+ * anything further out still goes through libm */
+#define TRIG_TABLE_MIN (-2*MAX_BEARING)
+#define TRIG_TABLE_MAX (2*MAX_BEARING)
+#define TRIG_TABLE_SIZE (TRIG_TABLE_MAX - TRIG_TABLE_MIN)
+
+static double sin_table[TRIG_TABLE_SIZE];
+static double cos_table[TRIG_TABLE_SIZE];
+
+#ifdef FIXED_POINT_TRIG
+/* The same values in fixed point, with TRIG_SHIFT fractional bits: all
+ * the (non-negligible) values in the table are at least 2^-8, so their
+ * doubles fit exactly */
+#define TRIG_SHIFT 62
+static int64_t sin_fixed[TRIG_TABLE_SIZE];
+static int64_t cos_fixed[TRIG_TABLE_SIZE];
+#endif
+
+void init_trig_table(void)
+{
+	for (int b = TRIG_TABLE_MIN; b < TRIG_TABLE_MAX; ++b) {
+		double rad = b*M_PI/(MAX_BEARING/2);
+		sin_table[b - TRIG_TABLE_MIN] = sin(rad);
+		cos_table[b - TRIG_TABLE_MIN] = cos(rad);
+#ifdef FIXED_POINT_TRIG
+		sin_fixed[b - TRIG_TABLE_MIN] = llrint(ldexp(sin(rad), TRIG_SHIFT));
+		cos_fixed[b - TRIG_TABLE_MIN] = llrint(ldexp(cos(rad), TRIG_SHIFT));
+#endif
+	}
+}
+
+static inline bool in_trig_table(int bearing)
+{
+	return bearing >= TRIG_TABLE_MIN && bearing < TRIG_TABLE_MAX;
+}
+
+#ifdef FIXED_POINT_TRIG
+/* c - delta*s in fixed point, truncated towards zero like the conversion
+ * of the floating-point expression. The floating-point result can only be
+ * different when the exact one is within a few ulps of an integer (where
+ * the rounding of the double operations, or the rounding of the tiny
+ * sin(pi) & co. to fixed point, can push it across), so we tell the caller
+ * to redo those (rare) cases in floating point */
+static inline bool fixed_coord(int *dst, int c, int delta, int64_t s)
+{
+	const __int128 one = (__int128)1 << TRIG_SHIFT;
+	const __int128 v = c*one - (__int128)delta*s;
+	const __int128 frac = v % one; /* same sign as v */
+	const __int128 margin = one >> 40;
+	if (frac < margin - one || (frac > -margin && frac < margin) ||
+		frac > one - margin)
+		return false;
+	*dst = v / one;
+	return true;
+}
+#endif
+
 void new_pos(struct control *dst, struct control const *src, int delta)
 {
-	double rad = dst->bearing*M_PI/(MAX_BEARING/2);
-	dst->cx = src->cx - delta*sin(rad);
-	dst->cy = src->cy - delta*cos(rad);
+	if (__builtin_expect(!in_trig_table(dst->bearing), 0)) {
+		double rad = dst->bearing*M_PI/(MAX_BEARING/2);
+		dst->cx = src->cx - delta*sin(rad);
+		dst->cy = src->cy - delta*cos(rad);
+		return;
+	}
+	const int b = dst->bearing - TRIG_TABLE_MIN;
+#ifdef FIXED_POINT_TRIG
+	if (!fixed_coord(&dst->cx, src->cx, delta, sin_fixed[b]))
+		dst->cx = src->cx - delta*sin_table[b];
+	if (!fixed_coord(&dst->cy, src->cy, delta, cos_fixed[b]))
+		dst->cy = src->cy - delta*cos_table[b];
+#else
+	dst->cx = src->cx - delta*sin_table[b];
+	dst->cy = src->cy - delta*cos_table[b];
+#endif
 }
 
 static const char * class[] = {
@@ -98,9 +276,10 @@ static const int thickness[] = {
  * low-quality line endings
  */
 /* TODO support this in the eye feature too (STARCROSS = put the eyeball */
-/* TODO consider drawing all understrikes first, and all overstrikes next,
- * avoiding criss-crossing in case of overlaps in all cases
- */
+/* Features are drawn one after the other, each with its understrikes and
+ * overstrikes, but circles are then normally drawn with all the
+ * understrikes first, and all the overstrikes next (see dl_sort_strokes()),
+ * so that overlapping features don't criss-cross */
 
 /* Compute the circle radius/delta to move from cx/cy to find the vertices
  * considering the thickness of the feature to draw */
@@ -110,12 +289,34 @@ int delta(struct control const *pos, bool hairline)
 
 }
 
-/* Print the unused flags */
-void print_missing_flags(int flags, int used)
+/* What the groups of primitives of the display list are */
+enum group_kind {
+	GROUP_CIRCLE,
+	GROUP_EYE,
+	GROUP_POLYGON,
+};
+
+static void begin_group(struct display_list *dl, enum group_kind kind,
+	int order)
 {
-	if (flags)
-		printf("<!-- flags %#x/%#x ignored -->\n",
-			flags, flags | used);
+	struct dl_prim *prim = dl_add(dl, DL_GROUP, 0);
+	prim->group.kind = kind;
+	prim->group.order = order;
+}
+
+static void end_group(struct display_list *dl)
+{
+	dl_add(dl, DL_END_GROUP, 0);
+}
+
+/* Note the unused flags */
+void note_missing_flags(struct display_list *dl, int flags, int used)
+{
+	if (flags) {
+		struct dl_prim *prim = dl_add(dl, DL_NOTE, 0);
+		prim->note.flags = flags;
+		prim->note.all = flags | used;
+	}
 }
 
 int get_next_vertex(int i, int sides, bool starcross)
@@ -131,33 +332,172 @@ int get_next_vertex(int i, int sides, bool starcross)
 		return -i/2;
 }
 
-void poly_path_spec(struct control const *vertex, int sides,
-	bool starcross)
+/* Polygon vertex templates: the offsets of the vertices of a polygon
+ * from its centre only depend on the number of sides, the bearing and the
+ * radius, and the same few combinations come up over and over (the
+ * FLIPROT/STARCROSS re-draws of the same polygon, the same feature in
+ * different circles, the replicas on the vertices of a feature), so they
+ * are computed once and kept in a small direct-mapped cache. One cache
+ * per thread, so there's no locking.
+ *
+ * The offsets are kept as the very doubles new_pos() subtracts from the
+ * centre, before truncation, so that the vertices come out exactly as
+ * new_pos() would put them, whatever the centre. (Templates per number of
+ * sides, rotated by the bearing, would not: the rotated doubles differ
+ * from the sines and cosines of the rotated bearings in the last bits,
+ * which is enough to move some truncated coordinates) */
+struct poly_template {
+	int sides; /* 0 for an empty slot */
+	int bearing;
+	int delta;
+	double dx[MAX_NVERT]; /* delta*sin(vertex bearing) */
+	double dy[MAX_NVERT]; /* delta*cos(vertex bearing) */
+};
+
+#define POLY_TEMPLATE_CACHE_SIZE 256 /* power of two */
+
+static __thread struct poly_template poly_template_cache[POLY_TEMPLATE_CACHE_SIZE];
+
+static struct poly_template const *poly_template(int sides, int bearing, int delta)
+{
+	const uint hash = ((uint)bearing*MAX_NVERT + sides)*2654435761U ^ (uint)delta;
+	struct poly_template *t = poly_template_cache +
+		((hash ^ (hash >> 16)) & (POLY_TEMPLATE_CACHE_SIZE - 1));
+	if (t->sides == sides && t->bearing == bearing && t->delta == delta)
+		return t;
+
+	const bool odd = sides & 1;
+	const int vb = MAX_BEARING/sides;
+	for (int i = 0; i < sides; ++i) {
+		const int b = bearing + vb*(i - odd*sides/2);
+		/* The same expressions as in new_pos() */
+		if (in_trig_table(b)) {
+			t->dx[i] = delta*sin_table[b - TRIG_TABLE_MIN];
+			t->dy[i] = delta*cos_table[b - TRIG_TABLE_MIN];
+		} else {
+			double rad = b*M_PI/(MAX_BEARING/2);
+			t->dx[i] = delta*sin(rad);
+			t->dy[i] = delta*cos(rad);
+		}
+	}
+	t->sides = sides;
+	t->bearing = bearing;
+	t->delta = delta;
+	return t;
+}
+
+/* Sub-features centred on the vertices of a feature are this much smaller
+ * than the feature */
+#define VERTEX_SCALE_DIV 9
+
+/* Compute the vertices of a polygon of the given radius, as the controls
+ * of the sub-features that can be drawn on them */
+void polygon_vertices(struct control *vertex, struct control const *pos,
+	int sides, int delta)
+{
+	const bool odd = sides & 1;
+	const int vb = MAX_BEARING/sides;
+	struct poly_template const *tmpl = poly_template(sides, pos->bearing, delta);
+	for (int i = 0; i < sides; ++i) {
+		struct control *v = vertex + i;
+		v->bearing = pos->bearing + vb*(i - odd*sides/2);
+		v->cx = pos->cx - tmpl->dx[i];
+		v->cy = pos->cy - tmpl->dy[i];
+		v->order = pos->order + 1;
+		v->scale = pos->scale/VERTEX_SCALE_DIV;
+	}
+}
+
+/* Shapes: polygons and eyes of the same size are drawn over and over in
+ * a circle, by the under- and overstrike passes, by the FLIPROT copies,
+ * and on each vertex of the features holding them, just moved and
+ * rotated. Each path in the display list carries its shape, so that the
+ * backends can make the most of it */
+enum shape_kind {
+	SHAPE_POLYGON,
+	SHAPE_EYE,
+};
+
+/* Indices in dl_shape.param */
+enum shape_param {
+	SHAPE_SIDES,
+	SHAPE_STARCROSS,
+	SHAPE_DELTA,
+	SHAPE_RADIUS,
+};
+
+/* Compute the points of the given shape drawn at pos, in drawing order,
+ * setting breaks like dl_prim.breaks. Returns the number of points */
+static int shape_points(struct dl_shape const *shape, struct control const *pos,
+	struct dl_point *points, uint16_t *breaks)
 {
-	printf("d='M %d %d", vertex[0].cx, vertex[0].cy);
-	for (int i = 1; i < sides; ++i) {
-		int j = get_next_vertex(i, sides, starcross);
-		bool unlinked = (j < 0);
-		if (j < 0) j = - j;
-		fprintf(stderr, "%d %d\n", i, j);
-		printf(" %s %d %d", unlinked ? "M" : "L", vertex[j].cx, vertex[j].cy);
+	struct control vertex[MAX_NVERT];
+	const int sides = shape->param[SHAPE_SIDES];
+	const int delta = shape->param[SHAPE_DELTA];
+	*breaks = 0;
+	switch (shape->kind) {
+	case SHAPE_POLYGON:
+		polygon_vertices(vertex, pos, sides, delta);
+		for (int i = 0; i < sides; ++i) {
+			int j = get_next_vertex(i, sides, shape->param[SHAPE_STARCROSS]);
+			bool unlinked = (j < 0);
+			if (j < 0) j = - j;
+			if (unlinked)
+				*breaks |= 1U << i;
+			points[i].x = vertex[j].cx;
+			points[i].y = vertex[j].cy;
+		}
+		return sides;
+	case SHAPE_EYE:
+		vertex[0].bearing = pos->bearing - MAX_BEARING/4;
+		vertex[1].bearing = pos->bearing + MAX_BEARING/4;
+		new_pos(vertex+0, pos, delta);
+		new_pos(vertex+1, pos, delta);
+		for (int i = 0; i < 2; ++i) {
+			points[i].x = vertex[i].cx;
+			points[i].y = vertex[i].cy;
+		}
+		return 2;
 	}
-	printf("z' ");
+	FATAL("unknown shape %d", shape->kind);
 }
 
-void eye_path_spec(struct control const *vertex, int r)
+/* Add the path of a shape drawn at pos with the given stroke, which the
+ * caller is about to draw `instances` times in a row */
+static void add_shape(struct display_list *dl, struct dl_shape const *shape,
+	struct control const *pos, enum dl_stroke stroke, int width,
+	int instances)
 {
-	printf("d='M %d %d "
-		"A %d %d 0 0 1 %d %d"
-		"A %d %d 0 0 1 %d %d"
-		"z' ",
-		vertex[0].cx, vertex[0].cy,
-		r, r, vertex[1].cx, vertex[1].cy,
-		r, r, vertex[0].cx, vertex[0].cy);
+	struct dl_point points[MAX_NVERT];
+	uint16_t breaks;
+	const int npoints = shape_points(shape, pos, points, &breaks);
+
+	struct dl_prim *prim = dl_add(dl,
+		shape->kind == SHAPE_EYE ? DL_ARC_PATH : DL_POLYLINE, npoints);
+	prim->stroke = stroke;
+	prim->width = width;
+	prim->breaks = breaks;
+	prim->path.shape = *shape;
+	prim->path.cx = pos->cx;
+	prim->path.cy = pos->cy;
+	prim->path.bearing = pos->bearing;
+	prim->path.radius = shape->param[SHAPE_RADIUS];
+	prim->path.instances = instances;
+	memcpy(prim->points, points, npoints*sizeof(*points));
 }
 
+static void add_circle(struct display_list *dl, struct control const *pos,
+	int r, enum dl_stroke stroke, int width)
+{
+	struct dl_prim *prim = dl_add(dl, DL_CIRCLE, 0);
+	prim->stroke = stroke;
+	prim->width = width;
+	prim->circle.cx = pos->cx;
+	prim->circle.cy = pos->cy;
+	prim->circle.r = r;
+}
 
-void draw_circle(struct control const *pos, int flags)
+void draw_circle(struct display_list *dl, struct control const *pos, int flags)
 {
 	const bool hairline = flags & HAIRLINE;
 	const int used_flags = flags & HAIRLINE;
@@ -165,21 +505,19 @@ void draw_circle(struct control const *pos, int flags)
 	const int thick = thickness[pos->order];
 	flags &= ~used_flags;
 
-	printf("<g class='%s circle'>\n", class[pos->order]);
-	print_missing_flags(flags, used_flags);
+	begin_group(dl, GROUP_CIRCLE, pos->order);
+	note_missing_flags(dl, flags, used_flags);
 	if (hairline) {
-		printf("<circle cx='%d' cy='%d' r='%d'/>\n",
-			pos->cx, pos->cy, dx);
+		add_circle(dl, pos, dx, DL_HAIRLINE, 0);
 	} else {
-		printf(	"<circle cx='%d' cy='%d' r='%d' stroke-width='%d'/>\n"
-			"<circle cx='%d' cy='%d' r='%d' stroke-width='%d' class='overstrike'/>\n",
-			pos->cx, pos->cy, dx, thick,
-			pos->cx, pos->cy, dx, thick - EXTRA_THICKNESS);
+		add_circle(dl, pos, dx, DL_UNDERSTROKE, thick);
+		add_circle(dl, pos, dx, DL_OVERSTROKE, thick - EXTRA_THICKNESS);
 	}
-	puts("</g>");
+	end_group(dl);
 }
 
-void draw_eye(struct control const *pos, int flags)
+void draw_eye(struct display_list *dl, struct control const *pos, int flags,
+	int copies)
 {
 	const bool hairline = flags & HAIRLINE;
 	const bool fliprot = flags & FLIPROT;
@@ -189,35 +527,32 @@ void draw_eye(struct control const *pos, int flags)
 	const int r = 3*pos->scale/2;
 	flags &= ~used_flags;
 
-	struct control vertex[2];
-	vertex[0].bearing = pos->bearing - MAX_BEARING/4;
-	vertex[1].bearing = pos->bearing + MAX_BEARING/4;
-	new_pos(vertex+0, pos, dx);
-	new_pos(vertex+1, pos, dx);
+	const struct dl_shape shape = { .kind = SHAPE_EYE,
+		.param = { [SHAPE_SIDES] = 2, [SHAPE_DELTA] = dx, [SHAPE_RADIUS] = r } };
 
-	printf("<g class='%s eye'>\n", class[pos->order]);
-	print_missing_flags(flags, used_flags);
-	printf("<path "); eye_path_spec(vertex, r);
+	begin_group(dl, GROUP_EYE, pos->order);
+	note_missing_flags(dl, flags, used_flags);
+	const int instances = copies*(fliprot ? 2 : 1)*(hairline ? 1 : 2);
 	if (hairline) {
-		puts("/>");
+		add_shape(dl, &shape, pos, DL_HAIRLINE, 0, instances);
 	} else {
-		printf("stroke-width='%d' />", thick);
-		printf("<path "); eye_path_spec(vertex, r);
-		printf("stroke-width='%d' class='overstrike' />\n",
-			thick - EXTRA_THICKNESS);
+		add_shape(dl, &shape, pos, DL_UNDERSTROKE, thick, instances);
+		add_shape(dl, &shape, pos, DL_OVERSTROKE,
+			thick - EXTRA_THICKNESS, instances);
 	}
-	puts("</g>");
+	end_group(dl);
 
-	/* TODO flag to put eyeball in the eye */
+	/* The eyeball, if any, is the inner sub-feature of the eye */
 
 	if (fliprot) {
 		struct control rot = *pos;
 		rot.bearing += MAX_BEARING/4;
-		draw_eye(&rot, (flags | used_flags) & ~FLIPROT);
+		draw_eye(dl, &rot, (flags | used_flags) & ~FLIPROT, copies);
 	}
 }
 
-void draw_polygon(struct control const *pos, int sides, int flags)
+void draw_polygon(struct display_list *dl, struct control const *pos, int sides,
+	int flags, int copies)
 {
 	const bool hairline = flags & HAIRLINE;
 	const bool fliprot = flags & FLIPROT;
@@ -228,16 +563,12 @@ void draw_polygon(struct control const *pos, int sides, int flags)
 	const bool odd = sides & 1;
 	flags &= ~used_flags;
 
-	/* TODO exploit symmetries */
-	struct control vertex[MAX_NVERT];
 	const int vb = MAX_BEARING/sides;
-	for (int i = 0; i < sides; ++i) {
-		struct control *v = vertex + i;
-		v->bearing = pos->bearing + vb*(i - odd*sides/2);
-		new_pos(v, pos, dx);
-		v->order = pos->order + 1;
-		v->scale -= thick;
-	}
+	const struct dl_shape shape = { .kind = SHAPE_POLYGON,
+		.param = { [SHAPE_SIDES] = sides, [SHAPE_STARCROSS] = starcross,
+			[SHAPE_DELTA] = dx } };
+	const int instances = copies*(fliprot && !starcross ? 2 : 1)*
+		(hairline ? 1 : 2);
 
 	/* Alternate polygon, drawn if fliprot.
 	 * If starcross, then the alternate polygon is just the standard
@@ -248,41 +579,36 @@ void draw_polygon(struct control const *pos, int sides, int flags)
 	if (!starcross)
 		alternate.bearing += odd ? MAX_BEARING/2 : vb/2;
 
-	printf("<g class='polygon %s'>\n", class[pos->order]);
-	print_missing_flags(flags, hairline);
+	begin_group(dl, GROUP_POLYGON, pos->order);
+	note_missing_flags(dl, flags, hairline);
 	if (hairline) {
-		printf("<path ");
-		poly_path_spec(vertex, sides, starcross);
-		puts("/>");
+		add_shape(dl, &shape, pos, DL_HAIRLINE, 0, instances);
 		if (fliprot && starcross) {
-			draw_polygon(&alternate, sides, (flags | hairline*HAIRLINE));
+			draw_polygon(dl, &alternate, sides, (flags | hairline*HAIRLINE), copies);
 		}
 	} else {
-		printf("<path ");
-		poly_path_spec(vertex, sides, starcross);
-		printf("stroke-width='%d' />", thick);
+		add_shape(dl, &shape, pos, DL_UNDERSTROKE, thick, instances);
 
 		if (fliprot && starcross) {
-			draw_polygon(&alternate, sides, (flags | hairline*HAIRLINE));
+			draw_polygon(dl, &alternate, sides, (flags | hairline*HAIRLINE), copies);
 		}
 
-		printf("<path ");
-		poly_path_spec(vertex, sides, starcross);
-		printf("stroke-width='%d' class='overstrike' />\n",
-			thick - EXTRA_THICKNESS);
+		add_shape(dl, &shape, pos, DL_OVERSTROKE,
+			thick - EXTRA_THICKNESS, instances);
 	}
-	puts("</g>");
+	end_group(dl);
 
 	if (fliprot && !starcross) {
 		struct control rot = *pos;
 		rot.bearing += odd ? MAX_BEARING/2 : vb/2;
-		draw_polygon(&rot, sides, (flags | hairline*HAIRLINE));
+		draw_polygon(dl, &rot, sides, (flags | hairline*HAIRLINE), copies);
 	}
 }
 
 
 
-void feature(struct control const *pos, uchar* val)
+void feature(struct display_list *dl, struct control const *pos,
+	uchar const *val, int copies)
 {
 	/* A major feature is encoded as a polygon with up to 8 sides
 	 * in the lower 3 bits, and a number of flags
@@ -294,36 +620,164 @@ void feature(struct control const *pos, uchar* val)
 
 	switch (sides) {
 	case 1:
-		draw_circle(pos, flags);
+		draw_circle(dl, pos, flags);
 		break;
 	case 2:
-		draw_eye(pos, flags);
+		draw_eye(dl, pos, flags, copies);
 		break;
 	default:
-		draw_polygon(pos, sides, flags);
+		draw_polygon(dl, pos, sides, flags, copies);
 	}
 }
 
-int main(int argc, char *argv[])
+/* The square of the drawing, centred on the origin: the same as the SVG
+ * viewBox */
+#define VIEW_ORIGIN (-850)
+#define VIEW_EXTENT 1700
+
+/* Sub-features: each feature (but those of the last order) has two
+ * slots for sub-features of the next order, one for a feature replicated
+ * on each of its vertices, and one for a feature inside it. Each slot of
+ * each feature is described by its own byte of the digest, handed out in
+ * drawing order after the byte of the primary feature, so that the
+ * replicas on the vertices of a feature have sub-features of their own.
+ * The replicas on the vertices of a feature share their byte, and thus
+ * their shape, but for features with an even number of vertices, whose
+ * replicas alternate between two bytes. That's at most 3 bytes for the
+ * slots of each feature, for the primary feature and the 9 features of
+ * the next order it can hold, that is 31 bytes of the digest.
+ *
+ * The flag bits of the features that are unused by the drawing functions
+ * select whether the slot is filled at all: if neither is set (one time
+ * in four) the slot is left empty */
+#define SUBFEATURE_MASK (STARCROSS >> 1 | STARCROSS >> 2)
+
+/* Enough for the pending siblings at each order along the current path */
+#define FEATURE_STACK_SIZE ((MAX_NVERT + 1)*ARRAY_SIZE(class))
+
+struct feature_work {
+	struct control pos;
+	int slot; /* index of the digest byte describing the feature */
+	int copies; /* number of replicas of the feature in the circle */
+};
+
+/* Compute the controls of the sub-features of the feature described by
+ * val, drawn at pos. Returns the number of vertex controls in vertex, and
+ * sets inner->scale to 0 if there's no room inside the feature */
+static int sub_feature_controls(struct control *vertex, struct control *inner,
+	struct control const *pos, uchar val)
 {
-	const bool has_arg = (argc > 1);
+	const int sides = (val & SIDES_MASK) + 1;
+	const bool hairline = val & HAIRLINE;
+	const int dx = delta(pos, hairline);
+	const int thick = thickness[pos->order];
+	int nvert = 0;
 
-	uchar pool[SHA256_DIGEST_LENGTH];
+	*inner = *pos;
+	inner->order = pos->order + 1;
+
+	switch (sides) {
+	case 1:
+		inner->scale = dx - thick;
+		break;
+	case 2:
+		/* The corners of the eye, and the eyeball */
+		for (int i = 0; i < 2; ++i) {
+			struct control *v = vertex + nvert++;
+			*v = *inner;
+			v->bearing = pos->bearing + (2*i - 1)*MAX_BEARING/4;
+			v->scale = pos->scale/VERTEX_SCALE_DIV;
+			new_pos(v, pos, dx);
+		}
+		inner->scale = pos->scale/3;
+		break;
+	default:
+		polygon_vertices(vertex, pos, sides, dx);
+		nvert = sides;
+		/* Radius of the inscribed circle */
+		inner->scale = dx*cos(M_PI/sides) - thick;
+	}
 
-	SHA256((uchar*)argv[has_arg], has_arg ? strlen(argv[1]) : 0, pool);
+	/* Don't bother with features too small to be told apart */
+	const int min_scale = 2*thickness[pos->order + 1];
+	if (inner->scale < min_scale)
+		inner->scale = 0;
+	if (!nvert)
+		return 0;
 
-	puts("<svg "
-#if 0
-		"style='background-color: darkgray' "
-#endif
-		"xmlns='http://www.w3.org/2000/svg' "
-		"xmlns:xlink='http://www.w3.org/1999/xlink' "
-		"viewBox='-850 -850 1700 1700'>");
-	puts("<style>");
-	puts("* { stroke: black; fill: none }");
-	puts(".overstrike { stroke: white }");
-	puts("</style>");
+	/* Vertex features smaller than that are grown to that size, as
+	 * long as they neither overlap the features on the neighbouring
+	 * vertices nor get out of the drawing */
+	int scale = vertex[0].scale;
+	if (scale < min_scale)
+		scale = min_scale;
+	const int spacing = dx*sin(M_PI/nvert);
+	const int room = -VIEW_ORIGIN - (int)hypot(pos->cx, pos->cy) - dx;
+	if (scale > spacing)
+		scale = spacing;
+	if (scale > room)
+		scale = room;
+	if (scale < min_scale)
+		return 0;
+	for (int i = 0; i < nvert; ++i)
+		vertex[i].scale = scale;
+	return nvert;
+}
+
+/* Draw the feature described by pool[0] at root, and its sub-features.
+ * The feature tree is walked depth-first with an explicit stack, so the
+ * cost is bounded by the number of slots, whatever the digest */
+void draw_features(struct display_list *dl, struct control const *root,
+	uchar const *pool)
+{
+	struct feature_work stack[FEATURE_STACK_SIZE];
+	size_t top = 0;
+	int next_slot = 1;
 
+	stack[top++] = (struct feature_work){
+		.pos = *root, .slot = 0, .copies = 1 };
+	while (top) {
+		const struct feature_work work = stack[--top];
+		uchar val = pool[work.slot];
+
+		/* The primary feature is always there */
+		if (work.slot) {
+			if (!(val & SUBFEATURE_MASK))
+				continue;
+			val &= ~SUBFEATURE_MASK;
+		}
+		feature(dl, &work.pos, &val, work.copies);
+
+		if (work.pos.order + 1 >= (int)ARRAY_SIZE(class))
+			continue;
+
+		struct control vertex[MAX_NVERT], inner;
+		const int nvert = sub_feature_controls(vertex, &inner, &work.pos, val);
+		const int alternate = !(nvert & 1);
+		const int vertex_slot = next_slot;
+		if (nvert)
+			next_slot += 1 + alternate;
+		if (inner.scale)
+			next_slot += 1;
+		if (next_slot > SHA256_DIGEST_LENGTH)
+			FATAL("feature slots past the end of the digest");
+		if (top + nvert + 1 > ARRAY_SIZE(stack))
+			FATAL("feature stack overflow");
+		/* Pushed in reverse, so that the vertex features are drawn
+		 * first, in order */
+		if (inner.scale)
+			stack[top++] = (struct feature_work){
+				.pos = inner, .slot = next_slot - 1, .copies = 1 };
+		for (int i = nvert; i-- > 0; )
+			stack[top++] = (struct feature_work){
+				.pos = vertex[i], .slot = vertex_slot + (i & alternate),
+				.copies = nvert >> alternate };
+	}
+}
+
+/* Draw the whole circle for the given spell digest */
+void draw_magic_circle(struct display_list *dl, const uchar *pool)
+{
 	struct control pos = {
 		.cx = 0, .cy = 0,
 		.scale = 840,
@@ -331,14 +785,773 @@ int main(int argc, char *argv[])
 		.bearing = 0 };
 
 	/* Primary circle: always there, for the time being */
-	draw_circle(&pos, 0);
+	draw_circle(dl, &pos, 0);
 
 	pos.scale -= thickness[pos.order];
 	pos.order += 1;
 
-	/* Primary feature */
-	feature(&pos, pool);
+	/* Primary feature, and all of its sub-features */
+	draw_features(dl, &pos, pool);
+}
+
+/* SVG backend. Runs of primitives with the same stroke (as found in
+ * display lists sorted into layers, see dl_sort_strokes()) are drawn as
+ * a single <path>, combining their path data. Otherwise, the path of
+ * each shape drawn several times is defined only once per document, in
+ * <defs>, around the origin and at bearing 0, and then drawn by <use>
+ * elements with the appropriate transform. The stroke of the path is
+ * inherited from the <use>, so that the same shape can be drawn with any
+ * stroke */
+
+static void svg_path_data(struct svg_buf *out, enum dl_op op,
+	struct dl_point const *points, int npoints, uint breaks, int radius)
+{
+	svg_lit(out, "M ");
+	svg_point(out, points[0].x, points[0].y);
+	if (op == DL_ARC_PATH) {
+		for (int i = 1; i <= npoints; ++i) {
+			if (i == 1)
+				svg_lit(out, " A ");
+			else
+				svg_lit(out, "A ");
+			svg_point(out, radius, radius);
+			svg_lit(out, " 0 0 1 ");
+			svg_point(out, points[i % npoints].x, points[i % npoints].y);
+		}
+	} else {
+		for (int i = 1; i < npoints; ++i) {
+			if (breaks & (1U << i))
+				svg_lit(out, " M ");
+			else
+				svg_lit(out, " L ");
+			svg_point(out, points[i].x, points[i].y);
+		}
+	}
+	svg_lit(out, "z");
+}
+
+static void svg_path_spec(struct svg_buf *out, enum dl_op op,
+	struct dl_point const *points, int npoints, uint breaks, int radius)
+{
+	svg_lit(out, "d='");
+	svg_path_data(out, op, points, npoints, breaks, radius);
+	svg_lit(out, "' ");
+}
+
+/* Path data of a circle, as two half circles */
+static void svg_circle_data(struct svg_buf *out, int cx, int cy, int r)
+{
+	svg_lit(out, "M ");
+	svg_point(out, cx - r, cy);
+	svg_lit(out, " A ");
+	svg_point(out, r, r);
+	svg_lit(out, " 0 0 1 ");
+	svg_point(out, cx + r, cy);
+	svg_lit(out, "A ");
+	svg_point(out, r, r);
+	svg_lit(out, " 0 0 1 ");
+	svg_point(out, cx - r, cy);
+	svg_lit(out, "z");
+}
+
+/* Append the rotation of the given bearing (in 1..MAX_BEARING - 1), in
+ * degrees with up to 3 decimals. Bearings go clockwise from the top,
+ * which is anti-clockwise in SVG coordinates */
+static void svg_bearing_angle(struct svg_buf *out, int bearing)
+{
+	const int millideg = ((MAX_BEARING - bearing)*360000 + MAX_BEARING/2)
+		/ MAX_BEARING;
+	svg_int(out, millideg/1000);
+	int frac = millideg % 1000;
+	if (frac) {
+		int digits = 3;
+		while (!(frac % 10)) {
+			frac /= 10;
+			--digits;
+		}
+		char buf[4] = ".000";
+		for (int i = digits; i > 0; --i, frac /= 10)
+			buf[i] = '0' + frac % 10;
+		svg_append(out, buf, digits + 1);
+	}
+}
+
+/* Append the <use> of shape id for the given path, up to the other
+ * attributes */
+static void svg_use(struct svg_buf *out, int id, struct dl_prim const *prim)
+{
+	svg_lit(out, "<use xlink:href='#s");
+	svg_int(out, id);
+	svg_lit(out, "' ");
+
+	const int cx = prim->path.cx, cy = prim->path.cy;
+	const int bearing = (prim->path.bearing % MAX_BEARING + MAX_BEARING) % MAX_BEARING;
+	if (!cx && !cy && !bearing)
+		return;
+	svg_lit(out, "transform='");
+	if (cx || cy) {
+		svg_lit(out, "translate(");
+		svg_point(out, cx, cy);
+		svg_lit(out, ")");
+	}
+	if (bearing) {
+		svg_lit(out, "rotate(");
+		svg_bearing_angle(out, bearing);
+		svg_lit(out, ")");
+	}
+	svg_lit(out, "' ");
+}
+
+/* Start the element drawing a path: either a plain <path>, or a <use> of
+ * its shape (defined here if needed), whichever is shorter (counting the
+ * definition against all the instances the producer expects). To be
+ * followed by the other attributes and the end of the tag */
+static void svg_begin_shape(struct svg_buf *out, struct dl_prim const *prim)
+{
+	const int instances = prim->path.instances;
+	const size_t start = out->len;
+	svg_lit(out, "<path ");
+	svg_path_spec(out, prim->op, prim->points, prim->npoints, prim->breaks,
+		prim->path.radius);
+	const size_t path_len = out->len - start;
+
+	struct dl_shape const *shape = &prim->path.shape;
+	int id = 0;
+	while (id < out->nshapes &&
+		memcmp(out->shapes + id, shape, sizeof(*shape)))
+		++id;
+	const bool defined = id < out->nshapes;
+	if (!defined && (instances < 2 || id == ARRAY_SIZE(out->shapes)))
+		return;
+
+	/* Append the alternative after the path, and keep the shorter */
+	const size_t alt = out->len;
+	if (!defined) {
+		static const struct control origin = { 0 };
+		struct dl_point points[MAX_NVERT];
+		uint16_t breaks;
+		const int npoints = shape_points(shape, &origin, points, &breaks);
+		svg_lit(out, "<defs><path id='s");
+		svg_int(out, id);
+		svg_lit(out, "' ");
+		svg_path_spec(out, prim->op, points, npoints, breaks,
+			prim->path.radius);
+		svg_lit(out, "/></defs>\n");
+	}
+	const size_t use = out->len;
+	svg_use(out, id, prim);
+	const size_t use_len = out->len - use;
+	const size_t alt_len = out->len - alt;
+	if (alt_len + (instances - 1)*use_len >= instances*path_len) {
+		out->len = alt;
+		return;
+	}
+	memmove(out->data + start, out->data + alt, alt_len);
+	out->len = start + alt_len;
+	if (!defined)
+		out->shapes[out->nshapes++] = *shape;
+}
+
+static void svg_circle(struct svg_buf *out, struct dl_prim const *prim)
+{
+	svg_lit(out, "<circle cx='");
+	svg_int(out, prim->circle.cx);
+	svg_lit(out, "' cy='");
+	svg_int(out, prim->circle.cy);
+	svg_lit(out, "' r='");
+	svg_int(out, prim->circle.r);
+	switch (prim->stroke) {
+	case DL_HAIRLINE:
+		svg_lit(out, "'/>\n");
+		break;
+	case DL_UNDERSTROKE:
+		svg_lit(out, "' stroke-width='");
+		svg_int(out, prim->width);
+		svg_lit(out, "'/>\n");
+		break;
+	case DL_OVERSTROKE:
+		svg_lit(out, "' stroke-width='");
+		svg_int(out, prim->width);
+		svg_lit(out, "' class='overstrike'/>\n");
+		break;
+	}
+}
+
+/* End a path element with the stroke of prim */
+static void svg_end_path(struct svg_buf *out, struct dl_prim const *prim)
+{
+	switch (prim->stroke) {
+	case DL_HAIRLINE:
+		svg_lit(out, "/>\n");
+		break;
+	case DL_UNDERSTROKE:
+		svg_lit(out, "stroke-width='");
+		svg_int(out, prim->width);
+		svg_lit(out, "' />");
+		break;
+	case DL_OVERSTROKE:
+		svg_lit(out, "stroke-width='");
+		svg_int(out, prim->width);
+		svg_lit(out, "' class='overstrike' />\n");
+		break;
+	}
+}
+
+static void svg_path(struct svg_buf *out, struct dl_prim const *prim)
+{
+	svg_begin_shape(out, prim);
+	svg_end_path(out, prim);
+}
+
+static bool is_stroke(struct dl_prim const *prim)
+{
+	return prim->op == DL_CIRCLE || prim->op == DL_POLYLINE ||
+		prim->op == DL_ARC_PATH;
+}
+
+/* Draw the primitives from first to last, which all have the same stroke,
+ * as a single path */
+static void svg_merged_path(struct svg_buf *out, struct display_list const *dl,
+	struct dl_prim const *first, struct dl_prim const *last)
+{
+	svg_lit(out, "<path d='");
+	for (struct dl_prim const *prim = first; ; prim = dl_next(dl, prim)) {
+		if (prim->op == DL_CIRCLE)
+			svg_circle_data(out, prim->circle.cx, prim->circle.cy,
+				prim->circle.r);
+		else
+			svg_path_data(out, prim->op, prim->points, prim->npoints,
+				prim->breaks, prim->path.radius);
+		if (prim == last)
+			break;
+	}
+	svg_lit(out, "' ");
+	svg_end_path(out, first);
+}
+
+static void svg_group(struct svg_buf *out, struct dl_prim const *prim)
+{
+	svg_lit(out, "<g class='");
+	switch (prim->group.kind) {
+	case GROUP_CIRCLE:
+		svg_str(out, class[prim->group.order]);
+		svg_lit(out, " circle'>\n");
+		break;
+	case GROUP_EYE:
+		svg_str(out, class[prim->group.order]);
+		svg_lit(out, " eye'>\n");
+		break;
+	case GROUP_POLYGON:
+		svg_lit(out, "polygon ");
+		svg_str(out, class[prim->group.order]);
+		svg_lit(out, "'>\n");
+		break;
+	}
+}
+
+/* Append the display list as an SVG document */
+void svg_render(struct svg_buf *out, struct display_list const *dl)
+{
+	out->nshapes = 0;
+
+	svg_lit(out, "<svg "
+#if 0
+		"style='background-color: darkgray' "
+#endif
+		"xmlns='http://www.w3.org/2000/svg' "
+		"xmlns:xlink='http://www.w3.org/1999/xlink' "
+		"viewBox='-850 -850 1700 1700'>\n"
+		"<style>\n"
+		"svg { stroke: black; fill: none }\n"
+		".overstrike { stroke: white }\n"
+		"</style>\n");
+
+	for (struct dl_prim const *prim = dl_next(dl, NULL); prim;
+		prim = dl_next(dl, prim)) {
+		switch (prim->op) {
+		case DL_GROUP:
+			svg_group(out, prim);
+			break;
+		case DL_END_GROUP:
+			svg_lit(out, "</g>\n");
+			break;
+		case DL_NOTE:
+			svg_lit(out, "<!-- flags ");
+			svg_hex(out, prim->note.flags);
+			svg_lit(out, "/");
+			svg_hex(out, prim->note.all);
+			svg_lit(out, " ignored -->\n");
+			break;
+		case DL_CIRCLE:
+		case DL_POLYLINE:
+		case DL_ARC_PATH: {
+			struct dl_prim const *last = prim, *next;
+			while ((next = dl_next(dl, last)) && is_stroke(next) &&
+				next->stroke == prim->stroke && next->width == prim->width)
+				last = next;
+			if (last != prim) {
+				svg_merged_path(out, dl, prim, last);
+				prim = last;
+			} else if (prim->op == DL_CIRCLE) {
+				svg_circle(out, prim);
+			} else {
+				svg_path(out, prim);
+			}
+			break;
+		}
+		}
+	}
+
+	svg_lit(out, "</svg>\n");
+}
+
+/* Write the whole buffer to f. Returns false on failure */
+static bool svg_flush(struct svg_buf *out, FILE *f)
+{
+	const bool ok = fwrite(out->data, 1, out->len, f) == out->len;
+	out->len = 0;
+	return ok;
+}
+
+/* Batch mode: generate the circles of many spells in a single process,
+ * so that each one only costs its hash and drawing. The spells are read
+ * one per line (or NUL-terminated) from the input, and each circle is
+ * either written to its own file, named after the position of the spell
+ * in the input, or appended to standard output as a frame: the size of
+ * the document in bytes, in decimal, on a line by itself, followed by
+ * the document. Circles can also be rasterized, as PPM or PNG images,
+ * rather than written as SVG */
+
+enum image_format {
+	FORMAT_SVG,
+	FORMAT_PPM,
+	FORMAT_PNG,
+};
+
+static const char *const format_name[] = {
+	[FORMAT_SVG] = "svg",
+	[FORMAT_PPM] = "ppm",
+	[FORMAT_PNG] = "png",
+};
+
+/* Default size of raster images, in pixels: one per unit of the drawing */
+#define DEFAULT_RASTER_SIZE VIEW_EXTENT
+#define MAX_RASTER_SIZE 16384
+
+/* Everything needed to turn a spell into a document, reused from one
+ * circle to the next */
+struct renderer {
+	enum image_format format;
+	bool grouped; /* draw feature by feature, rather than in layers */
+	struct display_list dl;
+	struct display_list layers; /* dl sorted into layers */
+	struct raster raster; /* raster formats only */
+	struct svg_buf doc; /* the document, whatever the format */
+};
+
+static void renderer_init(struct renderer *ren, enum image_format format,
+	int size, bool grouped)
+{
+	memset(ren, 0, sizeof(*ren));
+	ren->format = format;
+	ren->grouped = grouped;
+	dl_init(&ren->dl);
+	dl_init(&ren->layers);
+	if (format != FORMAT_SVG)
+		raster_init(&ren->raster, size, VIEW_ORIGIN, VIEW_EXTENT);
+}
+
+static void renderer_free(struct renderer *ren)
+{
+	dl_free(&ren->dl);
+	dl_free(&ren->layers);
+	raster_free(&ren->raster);
+	free(ren->doc.data);
+}
+
+/* Draw the circle of the digest into ren->doc */
+static void render_circle(struct renderer *ren, const uchar *pool)
+{
+	struct svg_buf *doc = &ren->doc;
+	struct display_list const *dl = &ren->dl;
+
+	dl_reset(&ren->dl);
+	draw_magic_circle(&ren->dl, pool);
+	if (!ren->grouped) {
+		dl_reset(&ren->layers);
+		dl_sort_strokes(&ren->layers, &ren->dl);
+		dl = &ren->layers;
+	}
+	switch (ren->format) {
+	case FORMAT_SVG:
+		svg_render(doc, dl);
+		break;
+	case FORMAT_PPM:
+		raster_render(&ren->raster, dl);
+		raster_ppm(&ren->raster, &doc->data, &doc->len, &doc->cap);
+		break;
+	case FORMAT_PNG:
+		raster_render(&ren->raster, dl);
+		raster_png(&ren->raster, &doc->data, &doc->len, &doc->cap);
+		break;
+	}
+}
+
+static void batch_usage(FILE *out, const char *prog)
+{
+	fprintf(out,
+		"Usage: %s --batch [options]\n"
+		"Draw the magic circle of each spell read from the input.\n"
+		"\n"
+		"  -i, --input=FILE   read the spells from FILE rather than stdin\n"
+		"  -0, --null         spells are NUL-terminated rather than one per line\n"
+		"  -o, --output=DIR   write the circle of the n-th spell (from 0) to\n"
+		"                     DIR/n.svg (or .ppm, .png), rather than as a\n"
+		"                     frame on stdout\n"
+		"  -f, --format=FMT   svg (the default), or ppm or png for raster images\n"
+		"  -s, --size=PIXELS  width and height of raster images (default %d)\n"
+		"  -j, --jobs=N       draw N circles at a time, with N threads\n"
+		"  -g, --grouped      draw the features one by one, each in a group,\n"
+		"                     rather than all understrokes, then all overstrokes\n"
+		"  -h, --help         show this help\n"
+		"\n"
+		"Each frame is the size of the document, in bytes, on a line by\n"
+		"itself, followed by the document. Frames are in input order, even\n"
+		"with several jobs.\n",
+		prog, DEFAULT_RASTER_SIZE);
+}
+
+/* Draw the circle of a spell into ren->doc */
+static void spell_circle(struct digest_cache *cache, struct renderer *ren,
+	const char *spell, size_t len)
+{
+	uchar pool[SHA256_DIGEST_LENGTH];
+	cached_sha256(cache, (const uchar*)spell, len, pool);
+	render_circle(ren, pool);
+}
+
+/* Write the document of the index-th circle to the output directory, or
+ * as a frame on stdout if there is none. Returns false on failure */
+static bool write_circle(struct svg_buf *doc, size_t index,
+	enum image_format format, const char *outdir)
+{
+	if (outdir) {
+		char *path;
+		if (asprintf(&path, "%s/%zu.%s", outdir, index,
+			format_name[format]) < 0)
+		{
+			fprintf(stderr, "out of memory");
+			abort();
+		}
+		FILE *out = fopen(path, "w");
+		if (!out) {
+			fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+			free(path);
+			doc->len = 0;
+			return false;
+		}
+		const bool ok = svg_flush(doc, out) & !fclose(out);
+		if (!ok)
+			fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+		free(path);
+		return ok;
+	}
+
+	printf("%zu\n", doc->len);
+	return svg_flush(doc, stdout);
+}
+
+static bool batch_circle(struct digest_cache *cache, struct renderer *ren,
+	const char *spell, size_t len, size_t index, const char *outdir)
+{
+	spell_circle(cache, ren, spell, len);
+	return write_circle(&ren->doc, index, ren->format, outdir);
+}
+
+/* Parallel batch mode: each worker reads the next spell (the input is
+ * read under the lock, one spell at a time, so that spells keep their
+ * index) into slot index % nslots, then hashes and draws it with its own
+ * renderer, outside of the lock. Documents of circles going to their own
+ * file are written by the workers; otherwise the worker hands its
+ * document over to the slot, and the main thread writes out the frames
+ * of the slots in input order. Either way the main thread frees the
+ * slots in order, so that at most nslots circles are in flight */
+enum slot_state { SLOT_FREE, SLOT_BUSY, SLOT_READY };
+
+struct batch_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct digest_cache *cache;
+	FILE *in;
+	int delim;
+	const char *outdir;
+	enum image_format format;
+	int size; /* of raster images */
+	bool grouped;
+	size_t next; /* index of the next spell to read */
+	bool eof; /* no more spells to read */
+	bool failed; /* stop as soon as possible */
+	size_t nslots;
+	struct {
+		char *spell;
+		size_t spell_cap;
+		struct svg_buf doc;
+		bool ok;
+		enum slot_state state;
+	} *slots;
+};
+
+static void *batch_worker(void *arg)
+{
+	struct batch_pool *pool = arg;
+	struct renderer ren;
+	renderer_init(&ren, pool->format, pool->size, pool->grouped);
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->eof && !pool->failed) {
+		const size_t index = pool->next;
+		const size_t s = index % pool->nslots;
+		if (pool->slots[s].state != SLOT_FREE) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		ssize_t len = getdelim(&pool->slots[s].spell,
+			&pool->slots[s].spell_cap, pool->delim, pool->in);
+		if (len < 0) {
+			pool->eof = true;
+			pthread_cond_broadcast(&pool->cond);
+			break;
+		}
+		++pool->next;
+		pool->slots[s].state = SLOT_BUSY;
+		pthread_mutex_unlock(&pool->lock);
+
+		const char *spell = pool->slots[s].spell;
+		if (len && spell[len-1] == pool->delim)
+			--len;
+		spell_circle(pool->cache, &ren, spell, len);
+		bool ok = true;
+		if (pool->outdir) {
+			ok = write_circle(&ren.doc, index, pool->format, pool->outdir);
+		} else {
+			const struct svg_buf doc = pool->slots[s].doc;
+			pool->slots[s].doc = ren.doc;
+			ren.doc = doc;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		pool->slots[s].ok = ok;
+		pool->slots[s].state = SLOT_READY;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	renderer_free(&ren);
+	return NULL;
+}
+
+/* Draw the circles of all the spells of in with njobs workers. Returns
+ * false on failure */
+static bool batch_parallel(struct batch_pool *pool, int njobs)
+{
+	pool->nslots = 2*njobs;
+	pthread_t *threads = calloc(njobs, sizeof(*threads));
+	pool->slots = calloc(pool->nslots, sizeof(*pool->slots));
+	if (threads == NULL || pool->slots == NULL)
+	{
+		fprintf(stderr, "out of memory");
+		abort();
+	}
+
+	for (int t = 0; t < njobs; ++t) {
+		if (pthread_create(threads + t, NULL, batch_worker, pool)) {
+			fprintf(stderr, "failed to create worker thread\n");
+			abort();
+		}
+	}
+
+	for (size_t index = 0; ; ++index) {
+		const size_t s = index % pool->nslots;
+		pthread_mutex_lock(&pool->lock);
+		while (pool->slots[s].state != SLOT_READY &&
+			!(pool->eof && index == pool->next))
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		const bool done = pool->slots[s].state != SLOT_READY;
+		pthread_mutex_unlock(&pool->lock);
+		if (done)
+			break;
+
+		bool ok = pool->slots[s].ok;
+		if (!pool->outdir)
+			ok = write_circle(&pool->slots[s].doc, index, pool->format, NULL);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->slots[s].state = SLOT_FREE;
+		if (!ok)
+			pool->failed = true;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+		if (!ok)
+			break;
+	}
+
+	for (int t = 0; t < njobs; ++t)
+		pthread_join(threads[t], NULL);
+	for (size_t s = 0; s < pool->nslots; ++s) {
+		free(pool->slots[s].spell);
+		free(pool->slots[s].doc.data);
+	}
+	free(pool->slots);
+	free(threads);
+	return !pool->failed;
+}
+
+static int batch(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "input", required_argument, NULL, 'i' },
+		{ "null", no_argument, NULL, '0' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "format", required_argument, NULL, 'f' },
+		{ "size", required_argument, NULL, 's' },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "grouped", no_argument, NULL, 'g' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *input = NULL;
+	const char *outdir = NULL;
+	enum image_format format = FORMAT_SVG;
+	long size = DEFAULT_RASTER_SIZE;
+	int jobs = 1;
+	bool grouped = false;
+	int delim = '\n';
+	int opt;
+	char *end;
+
+	/* argv[1] is --batch */
+	optind = 2;
+	while ((opt = getopt_long(argc, argv, "i:0o:f:s:j:gh", options, NULL)) != -1) {
+		switch (opt) {
+		case 'i':
+			input = optarg;
+			break;
+		case '0':
+			delim = '\0';
+			break;
+		case 'o':
+			outdir = optarg;
+			break;
+		case 'f':
+			for (format = 0; format < ARRAY_SIZE(format_name); ++format)
+				if (!strcmp(optarg, format_name[format]))
+					break;
+			if (format == ARRAY_SIZE(format_name)) {
+				fprintf(stderr, "unknown format %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			errno = 0;
+			size = strtol(optarg, &end, 10);
+			if (errno || *end || size < 1 || size > MAX_RASTER_SIZE) {
+				fprintf(stderr, "invalid size %s (1 to %d pixels)\n",
+					optarg, MAX_RASTER_SIZE);
+				return 1;
+			}
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				fprintf(stderr, "invalid number of jobs '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'g':
+			grouped = true;
+			break;
+		case 'h':
+			batch_usage(stdout, argv[0]);
+			return 0;
+		default:
+			batch_usage(stderr, argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		batch_usage(stderr, argv[0]);
+		return 1;
+	}
+
+	FILE *in = input ? fopen(input, "r") : stdin;
+	if (!in) {
+		fprintf(stderr, "cannot open %s: %s\n", input, strerror(errno));
+		return 1;
+	}
+
+	struct digest_cache *cache = digest_cache_from_env();
+	bool ok = true;
+	if (jobs > 1) {
+		struct batch_pool pool = {
+			.lock = PTHREAD_MUTEX_INITIALIZER,
+			.cond = PTHREAD_COND_INITIALIZER,
+			.cache = cache,
+			.in = in,
+			.delim = delim,
+			.outdir = outdir,
+			.format = format,
+			.size = size,
+			.grouped = grouped,
+		};
+		ok = batch_parallel(&pool, jobs);
+	} else {
+		struct renderer ren;
+		renderer_init(&ren, format, size, grouped);
+		char *spell = NULL;
+		size_t spell_cap = 0;
+		ssize_t len;
+		size_t index = 0;
+		while (ok && (len = getdelim(&spell, &spell_cap, delim, in)) >= 0) {
+			if (len && spell[len-1] == delim)
+				--len;
+			ok = batch_circle(cache, &ren, spell, len, index++, outdir);
+		}
+		free(spell);
+		renderer_free(&ren);
+	}
+	if (ok && ferror(in)) {
+		fprintf(stderr, "cannot read %s: %s\n",
+			input ? input : "standard input", strerror(errno));
+		ok = false;
+	}
+	digest_cache_close(cache);
+	if (in != stdin)
+		fclose(in);
+	if (fflush(stdout))
+		ok = false;
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+	const bool has_arg = (argc > 1);
+
+	init_trig_table();
+
+	if (has_arg && !strcmp(argv[1], "--batch"))
+		return batch(argc, argv);
+
+	uchar pool[SHA256_DIGEST_LENGTH];
+
+	struct digest_cache *cache = digest_cache_from_env();
+	cached_sha256(cache, (uchar*)argv[has_arg], has_arg ? strlen(argv[1]) : 0, pool);
+	digest_cache_close(cache);
 
-	puts("</svg>");
+	struct renderer ren;
+	renderer_init(&ren, FORMAT_SVG, 0, false);
+	render_circle(&ren, pool);
+	svg_flush(&ren.doc, stdout);
+	renderer_free(&ren);
 	return 0;
 }